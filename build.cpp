@@ -20,6 +20,13 @@ int main(int argc, char** argv) {
     conf.generate_debug_info = true;
     conf.incremental_link = false;
     conf.remove_unref_funcs = true;
+    //conf.trace_file = ".\\bin\\build_trace.json"; // timeline for ui.perfetto.dev
+
+    // e.g. `build.exe -j 8`
+    parse_build_args(conf, argc, argv);
+
+    // reuse the dir listings saved with the build state, for find_all_files
+    use_discovery_cache(conf);
 
     #include "shared_lib/build.cpp"
     #include "executable/build.cpp"
@@ -6,26 +6,102 @@
 #include <vector>
 #include <algorithm>
 #include <cstdarg>
+#include <cstring>
 #include <unordered_map>
+#include <unordered_set>
 #include <fstream>
 #include <cassert>
 #include <algorithm>
-
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <atomic>
+#include <deque>
+#include <memory>
+#include <chrono>
+
+#ifdef _WIN32
 #define WIN32_LEAN_AND_MEAN
 #include <Windows.h>
 #include <strsafe.h>
 #include <shlobj_core.h>
-#include <msi.h>
 #include <shellapi.h>
+#include <winsock2.h>
+#include <ws2tcpip.h>
+#include <psapi.h>
 
 #pragma comment( lib, "Shell32" )
-#pragma comment( lib, "Msi" )
+#pragma comment( lib, "Ws2_32" )
+#pragma comment( lib, "Psapi" )
+#else
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+#include <spawn.h>
+#include <poll.h>
+#include <errno.h>
+#include <dirent.h>
+#include <netdb.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#ifdef __linux__
+#include <sys/inotify.h>
+#endif
+#endif
+
+typedef uint64_t uint64;
+
+// receives a child's output chunk by chunk, see run_command_streamed
+typedef std::function<void(const char* data, size_t len)> output_sink;
 
-std::string ReadFromPipe(HANDLE read_from);
-int run_command(const std::string& cmd, std::string& std_out, std::string& std_err);
+// a command as the argv the child receives, args[0] is the program
+typedef std::vector<std::string> command_args;
+
+#ifdef _WIN32
+static const char path_sep = '\\';
+#else
+static const char path_sep = '/';
+#endif
+
+int run_command(const command_args& args, std::string& std_out, std::string& std_err);
+int run_command_streamed(const command_args& args, const output_sink& on_stdout, std::string& std_err);
 
 struct target_config;
 
+// which compiler the command generators write commands for
+enum toolchain_type {
+    toolchain_msvc = 0,
+    toolchain_gcc,
+    toolchain_clang
+};
+
+// the linker gcc/clang run (-fuse-ld=). msvc always links with link.exe
+enum linker_type {
+    linker_default = 0,
+    linker_bfd,
+    linker_gold,
+    linker_lld,
+    linker_mold
+};
+
+enum lto_mode {
+    lto_none = 0,
+    lto_full,
+    lto_thin
+};
+
+// which build of the profile guided optimization pipeline this is, see build_project_pgo
+enum pgo_stage {
+    pgo_off = 0,
+    pgo_generate, // instrumented, writes a profile when it runs
+    pgo_use       // optimized with the profile
+};
+
 /* a `project` is an overall collection of targets with common settings 
 * lots of settings will be project-global for now.
 */
@@ -45,6 +121,83 @@ struct project_config {
     bool incremental_link = false;
     bool remove_unref_funcs = true;
 
+    // cl.exe on windows, g++ everywhere else. `compiler` overrides the program that is run
+    // (e.g. "clang++-17" or "x86_64-w64-mingw32-g++"), `build.exe --toolchain clang` picks one.
+#ifdef _WIN32
+    toolchain_type toolchain = toolchain_msvc;
+#else
+    toolchain_type toolchain = toolchain_gcc;
+#endif
+    std::string compiler = "";
+
+    // gcc/clang only. `linker` selects lld or mold, which link much faster than ld.bfd (`--linker mold`).
+    // split_debug_info keeps the debug info in .dwo files next to the objects (-gsplit-dwarf), so
+    // the linker doesn't copy it into the output. gdb_index has the linker write a .gdb_index
+    // section, so gdb doesn't build one every time it loads the binary (needs lld, mold or gold).
+    linker_type linker = linker_default;
+    bool split_debug_info = false;
+    bool gdb_index = false;
+
+    // link time optimization. lto_thin is clang's ThinLTO, gcc does a full -flto either way and
+    // msvc links with /LTCG:INCREMENTAL. with lto_cache_dir, ThinLTO keeps what it optimized
+    // between links, so a relink only redoes the modules that changed (clang only).
+    lto_mode lto = lto_none;
+    std::string lto_cache_dir = "";
+
+    // profile guided optimization: a non-empty pgo_train makes build_project_incremental build
+    // instrumented binaries, run pgo_train against them (a "{bin_dir}" in it becomes the dir they
+    // are in), and then build the real outputs optimized with the profile that wrote.
+    // profiles go to pgo_dir, empty -> <obj_dir>/pgo. `pgo` is set by the pipeline itself.
+    command_args pgo_train;
+    std::string pgo_dir = "";
+    pgo_stage pgo = pgo_off;
+
+    // max number of compile jobs to run at once. 0 -> number of hardware threads
+    unsigned int max_jobs = 0;
+
+    // GNU make jobserver (see jobserver_init). run by make, compiles and links take make's tokens.
+    // otherwise the build serves max_jobs tokens to what it runs, in a pipe or (jobserver_fifo, make 4.4) a fifo.
+    // `--no-jobserver` turns the serving off
+    bool use_jobserver = true;
+    bool jobserver_fifo = false;
+
+    // with a memory budget (`--memory-budget MB`), a compile or link only starts once the peak memory it
+    // needed last time (kept in the state file) fits in what the running ones leave of it. one that never
+    // ran is assumed to need as much as the hungriest action seen so far, and at least memory_unknown_mb.
+    // 0 -> no budget, only max_jobs
+    unsigned int memory_budget_mb = 0;
+    unsigned int memory_unknown_mb = 2048;
+
+    // the incremental build hashes preprocessor output straight from the pipe.
+    // set this to write it to <target_obj_dir>\*.i files instead (e.g. to look at them)
+    bool keep_preprocessed_files = false;
+
+    // shared object cache for the incremental build. empty -> disabled
+    std::string object_cache_dir = "";
+    unsigned int object_cache_max_mb = 2048;
+
+    // write a timeline of every action to this file (chrome trace_event json, open it in
+    // ui.perfetto.dev or chrome://tracing). empty -> nothing is recorded
+    std::string trace_file = "";
+
+    // instead of building, preprocess every source and write a report of what each header
+    // costs to this json file (and a summary to stdout). `build.exe --header-report <file>`
+    std::string header_report = "";
+
+    // keep running after the build, and rebuild whatever a file change affects. `build.exe --watch`
+    // changes arriving within watch_debounce_ms of each other are handled by one rebuild.
+    bool watch = false;
+    unsigned int watch_debounce_ms = 50;
+
+    // distributed compiles on tools/build_worker.cpp processes, given as "host:port" (`--worker host:port`).
+    // each worker takes remote_slots compiles at a time, on top of the max_jobs local ones. sources
+    // are preprocessed locally and links stay local. a worker that can't be reached (or doesn't
+    // answer within remote_timeout_s) is skipped for remote_retry_s, and its compiles run locally.
+    std::vector<std::string> remote_workers;
+    unsigned int remote_slots = 4;
+    unsigned int remote_timeout_s = 300;
+    unsigned int remote_retry_s = 30;
+
     std::vector<target_config> targets;
 };
 
@@ -67,10 +220,487 @@ struct target_config {
     std::vector<std::string> link_libs;
     std::string link_dir = "";
     std::string subsystem = "console";
+
+    // names of other targets that have to be linked before this one.
+    // a link_lib named after a target (e.g. "shared_lib.lib") counts as a dependency too.
+    std::vector<std::string> depends_on;
+
+    // precompiled header, given as a path like the src_files. it is compiled once per target
+    // and force-included (/FI) into every source, so sources don't have to #include it first.
+    std::string pch_header = "";
+
+    // unity build: compile generated .cpp files that each #include a batch of the src_files.
+    // batches average unity_batch_size files and never hold more than twice that. a batch also
+    // ends early once it reaches unity_max_bytes.
+    // sources in unity_exclude (full path or just the file name) are still compiled on their own.
+    bool unity_build = false;
+    unsigned int unity_batch_size = 8;
+    unsigned int unity_max_bytes = 512 * 1024;
+    std::vector<std::string> unity_exclude;
 };
 
-std::string generate_target_build_cmd(const project_config& conf, const target_config& targ) {
-    // start building options into flag strings 
+// each target gets its own intermediate dir, so targets can compile at the same time
+std::string target_obj_dir(const project_config& conf, const target_config& targ) {
+    return conf.obj_dir + path_sep + targ.target_name;
+}
+
+bool gnu_toolchain(const project_config& conf) {
+    return conf.toolchain != toolchain_msvc;
+}
+
+// the program that compiles and links
+std::string compiler_program(const project_config& conf) {
+    if (conf.compiler.size()) return conf.compiler;
+    switch (conf.toolchain) {
+        case toolchain_msvc:  return "cl.exe";
+        case toolchain_gcc:   return "g++";
+        case toolchain_clang: return "clang++";
+    }
+    return "cl.exe";
+}
+
+std::string pgo_root(const project_config& conf) {
+    return conf.pgo_dir.size() ? conf.pgo_dir : conf.obj_dir + path_sep + "pgo";
+}
+
+// where the instrumented binaries write their profiles (and msvc keeps its .pgd files)
+std::string pgo_raw_dir(const project_config& conf) {
+    return pgo_root(conf) + path_sep + "raw";
+}
+
+// clang's profiles are merged into this one file before they are used
+std::string pgo_merged_file(const project_config& conf) {
+    return pgo_root(conf) + path_sep + "merged.profdata";
+}
+
+// a hash of the last profile. everything built with the profile depends on it
+std::string pgo_profile_id_file(const project_config& conf) {
+    return pgo_root(conf) + path_sep + "profile.id";
+}
+
+// the -fuse-ld= name of a linker, empty for the compiler's default
+const char* linker_name(linker_type linker) {
+    switch (linker) {
+        case linker_default: return "";
+        case linker_bfd:     return "bfd";
+        case linker_gold:    return "gold";
+        case linker_lld:     return "lld";
+        case linker_mold:    return "mold";
+    }
+    return "";
+}
+
+// parse the flags build.exe was run with, e.g. `build.exe -j 8`, `build.exe --watch`,
+// `build.exe --trace trace.json`, `build.exe --header-report headers.json`,
+// `build.exe --toolchain clang`, `build.exe --linker mold` or `build.exe --lto thin`
+void parse_build_args(project_config& conf, int argc, char* argv[]) {
+    for (int n = 1; n < argc; n++) {
+        if (strncmp(argv[n], "-j", 2) == 0) {
+            const char* num = argv[n] + 2;
+            if (*num == 0 && n + 1 < argc) num = argv[++n];
+            conf.max_jobs = (unsigned int)atoi(num);
+        } else if (strcmp(argv[n], "--header-report") == 0 && n + 1 < argc) {
+            conf.header_report = argv[++n];
+        } else if (strcmp(argv[n], "--trace") == 0 && n + 1 < argc) {
+            conf.trace_file = argv[++n];
+        } else if (strcmp(argv[n], "--watch") == 0) {
+            conf.watch = true;
+        } else if (strcmp(argv[n], "--memory-budget") == 0 && n + 1 < argc) {
+            conf.memory_budget_mb = (unsigned int)atoi(argv[++n]);
+        } else if (strcmp(argv[n], "--no-jobserver") == 0) {
+            conf.use_jobserver = false;
+        } else if (strcmp(argv[n], "--worker") == 0 && n + 1 < argc) {
+            conf.remote_workers.push_back(argv[++n]);
+        } else if (strcmp(argv[n], "--toolchain") == 0 && n + 1 < argc) {
+            const char* name = argv[++n];
+            if      (strcmp(name, "msvc") == 0)  conf.toolchain = toolchain_msvc;
+            else if (strcmp(name, "gcc") == 0)   conf.toolchain = toolchain_gcc;
+            else if (strcmp(name, "clang") == 0) conf.toolchain = toolchain_clang;
+            else printf("unknown toolchain [%s]\n", name);
+        } else if (strcmp(argv[n], "--linker") == 0 && n + 1 < argc) {
+            const char* name = argv[++n];
+            bool found = false;
+            for (int l = linker_default; l <= linker_mold; l++) {
+                if (strcmp(name, linker_name((linker_type)l)) == 0) {
+                    conf.linker = (linker_type)l;
+                    found = true;
+                }
+            }
+            if (!found) printf("unknown linker [%s]\n", name);
+        } else if (strcmp(argv[n], "--lto") == 0 && n + 1 < argc) {
+            const char* mode = argv[++n];
+            if      (strcmp(mode, "none") == 0) conf.lto = lto_none;
+            else if (strcmp(mode, "full") == 0) conf.lto = lto_full;
+            else if (strcmp(mode, "thin") == 0) conf.lto = lto_thin;
+            else printf("unknown lto mode [%s]\n", mode);
+        }
+    }
+}
+
+unsigned int get_job_count(const project_config& conf) {
+    if (conf.max_jobs) return conf.max_jobs;
+
+    unsigned int hw = std::thread::hardware_concurrency();
+    return hw ? hw : 1;
+}
+
+// "src\\main.cpp" -> "main"
+std::string file_stem(const std::string& path) {
+    size_t last_slash = path.find_last_of("\\/") + 1; // npos + 1 == 0
+    size_t last_dot   = path.find_last_of('.');
+    if (last_dot == std::string::npos || last_dot < last_slash) last_dot = path.size();
+    return path.substr(last_slash, last_dot - last_slash);
+}
+
+// the object file cl.exe writes for src_file when given `/Fo: <target_obj_dir>\`, or gcc is told to write with -o
+std::string obj_file_for(const project_config& conf, const target_config& targ, const std::string& src_file) {
+    std::string obj_name = file_stem(src_file) + (gnu_toolchain(conf) ? ".o" : ".obj");
+    return target_obj_dir(conf, targ) + path_sep + obj_name;
+}
+
+// what `/Fe: <bin_dir>\<target_name>` ends up producing, or the usual names on linux
+std::string target_output_file(const project_config& conf, const target_config& targ) {
+    std::string out = conf.bin_dir + path_sep + targ.target_name;
+    if (gnu_toolchain(conf)) {
+        std::string lib = conf.bin_dir + path_sep + "lib" + targ.target_name;
+        switch (targ.type) {
+            case executable: return out;
+            case shared_lib: return lib + ".so";
+            case static_lib: return lib + ".a";
+        }
+        return out;
+    }
+    switch (targ.type) {
+        case executable: return out + ".exe";
+        case shared_lib: return out + ".dll";
+        case static_lib: return out + ".lib";
+    }
+    return out;
+}
+
+// full path of `path`, relative paths are taken from the current dir
+std::string absolute_path(const std::string& path) {
+#ifdef _WIN32
+    char full_path[MAX_PATH];
+    if (GetFullPathNameA(path.c_str(), MAX_PATH, full_path, NULL) == 0) return path;
+    return full_path;
+#else
+    char* full_path = realpath(path.c_str(), NULL);
+    if (!full_path) return path;
+    std::string res = full_path;
+    free(full_path);
+    return res;
+#endif
+}
+
+// how watch mode and the header report compare paths: absolute, and on windows lower case with backslashes
+std::string watch_path(const std::string& path) {
+    std::string full = absolute_path(path);
+#ifdef _WIN32
+    for (char& c : full) c = (c == '/') ? '\\' : (char)tolower((unsigned char)c);
+#endif
+    return full;
+}
+
+// the generated source the precompiled header is built from: an empty .cpp that /Yc compiles,
+// or for gcc/clang a header that #includes pch_header
+std::string pch_source_file(const project_config& conf, const target_config& targ) {
+    if (gnu_toolchain(conf)) return target_obj_dir(conf, targ) + path_sep + targ.target_name + "_pch.h";
+    return target_obj_dir(conf, targ) + path_sep + targ.target_name + "_pch.cpp";
+}
+
+// gcc and clang look for <header>.gch / <header>.pch next to a header given with -include
+std::string pch_file(const project_config& conf, const target_config& targ) {
+    if (conf.toolchain == toolchain_gcc)   return pch_source_file(conf, targ) + ".gch";
+    if (conf.toolchain == toolchain_clang) return pch_source_file(conf, targ) + ".pch";
+    return target_obj_dir(conf, targ) + path_sep + targ.target_name + ".pch";
+}
+
+// what compiling src_file produces: its object, except the gcc/clang pch, which is just the pch file
+std::string compile_output_file(const project_config& conf, const target_config& targ, const std::string& src_file) {
+    if (gnu_toolchain(conf) && targ.pch_header.size() && src_file == pch_source_file(conf, targ)) return pch_file(conf, targ);
+    return obj_file_for(conf, targ, src_file);
+}
+
+// the file other targets link against: the import lib of a dll, otherwise the output itself
+std::string target_interface_file(const project_config& conf, const target_config& targ) {
+    if (targ.type == shared_lib && !gnu_toolchain(conf)) return conf.bin_dir + path_sep + targ.target_name + ".lib";
+    return target_output_file(conf, targ);
+}
+
+// append flags that never contain paths, e.g. "/nologo /Gm- ", as separate arguments
+void add_flags(command_args& args, const std::string& flags) {
+    size_t start = 0;
+    while (start < flags.size()) {
+        size_t end = flags.find(' ', start);
+        if (end == std::string::npos) end = flags.size();
+        if (end > start) args.push_back(flags.substr(start, end - start));
+        start = end + 1;
+    }
+}
+
+// for printing only. the child gets the arguments as-is, see process_group::spawn
+std::string command_line_string(const command_args& args) {
+    std::string line;
+    for (const auto& a : args) {
+        if (line.size()) line += ' ';
+        line += a;
+    }
+    return line;
+}
+
+/* gcc / clang.
+* the same project_config options as the cl.exe commands below, in gcc's flags (clang takes the same ones).
+* every compile also writes a Makefile-style depfile (-MD) next to its output, which is where the
+* incremental build gets the included headers from instead of /showIncludes.
+* warnings_to_ignore and subsystem are msvc things and have no effect here.
+*/
+// lto and pgo flags go to the compiles and the link alike
+void gnu_lto_pgo_flags(const project_config& conf, command_args& args) {
+    bool clang = conf.toolchain == toolchain_clang;
+    if (conf.lto == lto_thin && clang) args.push_back("-flto=thin");
+    else if (conf.lto != lto_none)     args.push_back(clang ? "-flto" : "-flto=auto");
+
+    if (conf.pgo == pgo_off) return;
+
+    // gcc names its profiles after the object path. the instrumented objects are in another obj_dir,
+    // so profile names are made relative to the obj_dir (as the path gcc sees it, it doesn't normalize)
+    std::string gcc_prefix = conf.obj_dir;
+    if (conf.obj_dir.empty() || (conf.obj_dir[0] != '/' && conf.obj_dir.find(':') == std::string::npos)) {
+        gcc_prefix = absolute_path(".") + path_sep + conf.obj_dir;
+    }
+
+    if (conf.pgo == pgo_generate) {
+        if (clang) {
+            args.push_back("-fprofile-instr-generate");
+        } else {
+            args.push_back("-fprofile-generate=" + absolute_path(pgo_raw_dir(conf)));
+            args.push_back("-fprofile-prefix-path=" + gcc_prefix);
+            args.push_back("-fprofile-update=atomic");
+        }
+    } else {
+        // code the training never ran has no profile, that isn't worth a warning (or an error with -Werror)
+        if (clang) {
+            // the merged file may not exist yet, and the path has to be the same once it does
+            args.push_back("-fprofile-instr-use=" + absolute_path(pgo_root(conf)) + path_sep + "merged.profdata");
+            add_flags(args, "-Wno-profile-instr-unprofiled -Wno-profile-instr-out-of-date");
+        } else {
+            args.push_back("-fprofile-use=" + absolute_path(pgo_raw_dir(conf)));
+            args.push_back("-fprofile-prefix-path=" + gcc_prefix);
+            args.push_back("-Wno-missing-profile");
+        }
+    }
+}
+
+void gnu_compile_flags(const project_config& conf, const target_config& targ, command_args& args) {
+    for (auto s : targ.include_dirs) {
+        args.push_back("-I" + s);
+    }
+
+    args.push_back("-std=c++" + std::to_string(conf.cpp_standard));
+    args.push_back("-O" + std::to_string(conf.opt_level));
+
+    if (conf.generate_debug_info) {
+        args.push_back("-g");
+        if (conf.split_debug_info) args.push_back("-gsplit-dwarf");
+    }
+
+    // shared libs need position independent code. executables are PIE by default anyway
+    if (targ.type == shared_lib) args.push_back("-fPIC");
+
+    // one section per function/variable, so the linker's --gc-sections can drop the unused ones (like /OPT:REF)
+    if (conf.remove_unref_funcs) add_flags(args, "-ffunction-sections -fdata-sections");
+
+    switch (targ.warning_level) {
+        case 0: args.push_back("-w"); break;
+        case 1: break; // the compiler's defaults
+        case 2: args.push_back("-Wall"); break;
+        case 3: add_flags(args, "-Wall -Wextra"); break;
+        case 4: add_flags(args, "-Wall -Wextra -Wpedantic"); break;
+    }
+
+    if (targ.warnings_are_errors) {
+        args.push_back("-Werror");
+    }
+
+    // what /MDd and /MTd define
+    if (conf.debug_build) args.push_back("-D_DEBUG");
+
+    for (auto d : conf.common_defines) {
+        args.push_back("-D" + d);
+    }
+    for (auto d : targ.defines) {
+        args.push_back("-D" + d);
+    }
+
+    gnu_lto_pgo_flags(conf, args);
+}
+
+// link_libs are written for cl.exe ("user32.lib", "shared_lib.lib"): a .lib becomes -l<name>,
+// which finds lib<name>.so or lib<name>.a in link_dir. anything else (-lm, -pthread, a path) is passed as-is.
+std::string gnu_link_lib(const std::string& lib) {
+    size_t last_dot = lib.find_last_of('.');
+    if (lib[0] != '-' && last_dot != std::string::npos && lib.substr(last_dot) == ".lib") {
+        return "-l" + file_stem(lib);
+    }
+    return lib;
+}
+
+// everything after the objects: the output, and how to link it
+void gnu_link_flags(const project_config& conf, const target_config& targ, command_args& args) {
+    args.push_back("-o");
+    args.push_back(target_output_file(conf, targ));
+
+    if (targ.type == shared_lib) {
+        args.push_back("-shared");
+        args.push_back("-Wl,-soname,lib" + targ.target_name + ".so");
+    }
+
+    if (conf.static_link_std) add_flags(args, "-static-libstdc++ -static-libgcc");
+    if (conf.remove_unref_funcs) args.push_back("-Wl,--gc-sections");
+
+    std::string linker = linker_name(conf.linker);
+    if (linker.size()) args.push_back("-fuse-ld=" + linker);
+
+    if (conf.gdb_index && conf.generate_debug_info) args.push_back("-Wl,--gdb-index");
+
+    if (conf.lto == lto_thin && conf.toolchain == toolchain_clang && conf.lto_cache_dir.size()) {
+        if (conf.linker == linker_lld) args.push_back("-Wl,--thinlto-cache-dir=" + conf.lto_cache_dir);
+        else                           args.push_back("-Wl,-plugin-opt,cache-dir=" + conf.lto_cache_dir);
+    }
+
+    if (targ.link_dir.size()) args.push_back("-L" + targ.link_dir);
+
+    // shared libs are put next to the executables, so look for them there at runtime, like windows does
+    if (targ.link_libs.size()) args.push_back("-Wl,-rpath,$ORIGIN");
+
+    for (auto l : targ.link_libs) {
+        args.push_back(gnu_link_lib(l));
+    }
+}
+
+// the pch is built from a header, every other source -includes that header, and the compiler
+// finds the .gch/.pch next to it (see pch_file)
+command_args gnu_compile_cmd(const project_config& conf, const target_config& targ, const std::string& src_file) {
+    std::string out_file = compile_output_file(conf, targ, src_file);
+    bool is_pch = targ.pch_header.size() && src_file == pch_source_file(conf, targ);
+
+    command_args args = {compiler_program(conf), "-c"};
+    gnu_compile_flags(conf, targ, args);
+
+    if (targ.pch_header.size() && !is_pch) {
+        args.push_back("-include");
+        args.push_back(pch_source_file(conf, targ));
+    }
+
+    args.push_back("-MD");
+    args.push_back("-MF");
+    args.push_back(out_file + ".d");
+
+    if (is_pch) {
+        args.push_back("-x");
+        args.push_back("c++-header");
+    }
+    args.push_back(src_file);
+
+    args.push_back("-o");
+    args.push_back(out_file);
+    return args;
+}
+
+// with conf.keep_preprocessed_files the output goes to `pre_file`, otherwise to stdout
+command_args gnu_preprocess_cmd(const project_config& conf, const target_config& targ, const std::string& src_file, std::string& pre_file) {
+    command_args args = {compiler_program(conf), "-E"};
+    for (auto s : targ.include_dirs) {
+        args.push_back("-I" + s);
+    }
+
+    args.push_back("-std=c++" + std::to_string(conf.cpp_standard));
+
+    if (conf.debug_build) args.push_back("-D_DEBUG");
+    for (auto d : conf.common_defines) {
+        args.push_back("-D" + d);
+    }
+    for (auto d : targ.defines) {
+        args.push_back("-D" + d);
+    }
+
+    // like cl.exe, sources leave the precompiled header out. the pch source #includes it itself
+    args.push_back(src_file);
+
+    if (!conf.keep_preprocessed_files) {
+        pre_file = "";
+        return args;
+    }
+
+    pre_file = target_obj_dir(conf, targ) + path_sep + file_stem(src_file) + ".i";
+    args.push_back("-o");
+    args.push_back(pre_file);
+    return args;
+}
+
+// ar only adds and replaces members, so the archive has to be deleted before it is rebuilt (see the link step).
+// lto objects need the ar that knows how to index them
+command_args gnu_link_cmd(const project_config& conf, const target_config& targ) {
+    if (targ.type == static_lib) {
+        const char* ar = "ar";
+        if (conf.lto != lto_none) ar = conf.toolchain == toolchain_clang ? "llvm-ar" : "gcc-ar";
+        command_args args = {ar, "rcs", target_output_file(conf, targ)};
+        for (auto s : targ.src_files) {
+            args.push_back(obj_file_for(conf, targ, s));
+        }
+        return args;
+    }
+
+    command_args args = {compiler_program(conf)};
+    for (auto s : targ.src_files) {
+        args.push_back(obj_file_for(conf, targ, s));
+    }
+
+    gnu_lto_pgo_flags(conf, args);
+    gnu_link_flags(conf, targ, args);
+    return args;
+}
+
+// compile and link in one call (the pch is built before, see build_project)
+command_args gnu_target_build_cmd(const project_config& conf, const target_config& targ) {
+    command_args args = {compiler_program(conf)};
+    gnu_compile_flags(conf, targ, args);
+
+    if (targ.pch_header.size()) {
+        args.push_back("-include");
+        args.push_back(pch_source_file(conf, targ));
+    }
+
+    for (auto s : targ.src_files) {
+        args.push_back(s);
+    }
+
+    gnu_link_flags(conf, targ, args);
+    return args;
+}
+
+// link time code generation, which lto and pgo both need. each target gets its own .pgd
+// (the instrumented link creates it, the training run adds .pgc files next to it)
+void msvc_ltcg_flags(const project_config& conf, const target_config& targ, command_args& args) {
+    std::string pgd = pgo_raw_dir(conf) + "\\" + targ.target_name + ".pgd";
+    if (conf.pgo == pgo_generate) {
+        args.push_back("/LTCG");
+        args.push_back("/GENPROFILE:PGD=" + pgd);
+    } else if (conf.pgo == pgo_use) {
+        args.push_back("/LTCG");
+        args.push_back("/USEPROFILE:PGD=" + pgd);
+    } else if (conf.lto == lto_thin) {
+        args.push_back("/LTCG:INCREMENTAL");
+    } else if (conf.lto == lto_full) {
+        args.push_back("/LTCG");
+    }
+}
+
+command_args generate_target_build_cmd(const project_config& conf, const target_config& targ) {
+    if (gnu_toolchain(conf)) return gnu_target_build_cmd(conf, targ);
+
+    // start building options into flag strings
     std::string default_flags = "/nologo /Gm- /GR- /EHa- /FC ";
 
     std::string std_cmd = "/std:c++" + std::to_string(conf.cpp_standard) + " ";
@@ -92,11 +722,12 @@ std::string generate_target_build_cmd(const project_config& conf, const target_c
     std::string compile_flags = default_flags + msvc_link + opt_cmd + std_cmd;
     if (conf.generate_debug_info) compile_flags += "/Z7 ";
     if (targ.type == shared_lib) compile_flags += "/LD ";
+    if (conf.lto != lto_none || conf.pgo != pgo_off) compile_flags += "/GL ";
 
 
 
     std::string link_flags = "/link ";
-    
+
     if (conf.incremental_link) link_flags += "/INCREMENTAL ";
     else                       link_flags += "/INCREMENTAL:NO ";
 
@@ -107,60 +738,79 @@ std::string generate_target_build_cmd(const project_config& conf, const target_c
     for (char & c: subsystem) c = toupper(c);
     link_flags += "/SUBSYSTEM:" + subsystem + " ";
 
-    if (targ.link_dir.size()) link_flags += "/LIBPATH:\"" + targ.link_dir + "\" ";
-
-    for (auto l : targ.link_libs) {
-        link_flags += l + " ";
-    }
-
     // assemble full command
     // cl %IncludeDirs% %CompilerFlags% %SrcFiles% /Fe: %OutputName% /Fo: %obj_dir% /link %LinkerFlags%
-    std::string compile_cmd = "cl.exe ";
+    command_args args = {compiler_program(conf)};
     for (auto s : targ.include_dirs) {
-        compile_cmd += "/I" + s + " ";
+        args.push_back("/I" + s);
     }
 
-    compile_cmd += compile_flags;
+    add_flags(args, compile_flags);
 
     switch (targ.warning_level) {
-        case 0: compile_cmd += "/W0 "; break;
-        case 1: compile_cmd += "/W1 "; break;
-        case 2: compile_cmd += "/W2 "; break;
-        case 3: compile_cmd += "/W3 "; break;
-        case 4: compile_cmd += "/W4 "; break;
+        case 0: args.push_back("/W0"); break;
+        case 1: args.push_back("/W1"); break;
+        case 2: args.push_back("/W2"); break;
+        case 3: args.push_back("/W3"); break;
+        case 4: args.push_back("/W4"); break;
     }
 
     if (targ.warnings_are_errors) {
-        compile_cmd += "/WX ";
+        args.push_back("/WX");
     }
 
     for (auto w : targ.warnings_to_ignore) {
-        compile_cmd += "/wd" + std::to_string(w) + " ";
+        args.push_back("/wd" + std::to_string(w));
     }
 
     for (auto d : conf.common_defines) {
-        compile_cmd += "/D" + d + " ";
+        args.push_back("/D" + d);
     }
     for (auto d : targ.defines) {
-        compile_cmd += "/D" + d + " ";
+        args.push_back("/D" + d);
+    }
+
+    // the pch object is created by a separate /Yc compile first, see build_project
+    if (targ.pch_header.size()) {
+        std::string header = absolute_path(targ.pch_header);
+        args.push_back("/Yu" + header);
+        args.push_back("/FI" + header);
+        args.push_back("/Fp" + pch_file(conf, targ));
     }
 
     for (auto s : targ.src_files) {
-        compile_cmd += s + " ";
+        args.push_back(s);
     }
+    if (targ.pch_header.size()) {
+        args.push_back(obj_file_for(conf, targ, pch_source_file(conf, targ)));
+    }
+
 
+    args.push_back("/Fe:");
+    args.push_back(conf.bin_dir + "\\" + targ.target_name);
+    args.push_back("/Fo:");
+    args.push_back(target_obj_dir(conf, targ) + "\\");
 
-    compile_cmd += "/Fe: " + conf.bin_dir + "\\" + targ.target_name + " ";
-    compile_cmd += "/Fo: " + conf.obj_dir + "\\ ";
+    add_flags(args, link_flags);
+    msvc_ltcg_flags(conf, targ, args);
 
-    compile_cmd += link_flags;
+    if (targ.link_dir.size()) args.push_back("/LIBPATH:" + targ.link_dir);
+
+    for (auto l : targ.link_libs) {
+        args.push_back(l);
+    }
 
-    return compile_cmd;
+    return args;
 }
 
-std::string generate_preprocess_cmd(const project_config& conf, const target_config& targ, const std::string& src_file, std::string& pre_file) {
-    // start building options into flag strings 
-    std::string default_flags = "/nologo /Gm- /GR- /EHa- /FC /P ";
+// with conf.keep_preprocessed_files the output goes to `pre_file`, otherwise to stdout
+command_args generate_preprocess_cmd(const project_config& conf, const target_config& targ, const std::string& src_file, std::string& pre_file) {
+    if (gnu_toolchain(conf)) return gnu_preprocess_cmd(conf, targ, src_file, pre_file);
+
+    // start building options into flag strings
+    std::string default_flags = "/nologo /Gm- /GR- /EHa- /FC ";
+    if (conf.keep_preprocessed_files) default_flags += "/P ";
+    else                              default_flags += "/E ";
 
     std::string std_cmd = "/std:c++" + std::to_string(conf.cpp_standard) + " ";
 
@@ -168,35 +818,47 @@ std::string generate_preprocess_cmd(const project_config& conf, const target_con
 
 
     // assemble full command
-    std::string compile_cmd = "cl.exe ";
+    command_args args = {compiler_program(conf)};
     for (auto s : targ.include_dirs) {
-        compile_cmd += "/I" + s + " ";
+        args.push_back("/I" + s);
     }
 
-    compile_cmd += compile_flags;
+    add_flags(args, compile_flags);
 
     for (auto d : conf.common_defines) {
-        compile_cmd += "/D" + d + " ";
+        args.push_back("/D" + d);
     }
     for (auto d : targ.defines) {
-        compile_cmd += "/D" + d + " ";
+        args.push_back("/D" + d);
+    }
+
+    // sources leave the precompiled header out: it is tracked through the pch's own hash,
+    // so there is no reason to parse it again here
+    if (targ.pch_header.size() && src_file == pch_source_file(conf, targ)) {
+        args.push_back("/FI" + absolute_path(targ.pch_header));
     }
 
-    compile_cmd += src_file + " ";
+    args.push_back(src_file);
+
+    if (!conf.keep_preprocessed_files) {
+        pre_file = "";
+        return args;
+    }
 
-    compile_cmd += "/Fi: " + conf.obj_dir + "\\ ";
+    args.push_back("/Fi:");
+    args.push_back(target_obj_dir(conf, targ) + "\\");
 
-    size_t last_slash = src_file.find_last_of('\\')+1;
-    size_t last_dot   = src_file.find_last_of('.');
-    std::string pre_name = src_file.substr(last_slash, last_dot - last_slash) + ".i";
-    pre_file = conf.obj_dir + "\\" + pre_name;
+    pre_file = target_obj_dir(conf, targ) + path_sep + file_stem(src_file) + ".i";
 
-    return compile_cmd;
+    return args;
 }
 
-std::string generate_compile_cmd(const project_config& conf, const target_config& targ, const std::string& src_file) {
-    // start building options into flag strings 
-    std::string default_flags = "/nologo /Gm- /GR- /EHa- /FC /c ";
+command_args generate_compile_cmd(const project_config& conf, const target_config& targ, const std::string& src_file) {
+    if (gnu_toolchain(conf)) return gnu_compile_cmd(conf, targ, src_file);
+
+    // start building options into flag strings
+    // (/showIncludes lists every header that gets pulled in, so the incremental build can track them)
+    std::string default_flags = "/nologo /Gm- /GR- /EHa- /FC /c /showIncludes ";
 
     std::string std_cmd = "/std:c++" + std::to_string(conf.cpp_standard) + " ";
 
@@ -217,49 +879,62 @@ std::string generate_compile_cmd(const project_config& conf, const target_config
     std::string compile_flags = default_flags + msvc_link + opt_cmd + std_cmd;
     if (conf.generate_debug_info) compile_flags += "/Z7 ";
     if (targ.type == shared_lib) compile_flags += "/LD ";
+    if (conf.lto != lto_none || conf.pgo != pgo_off) compile_flags += "/GL ";
 
 
     // assemble full command
     // cl %IncludeDirs% %CompilerFlags% %SrcFiles% /Fe: %OutputName% /Fo: %obj_dir% /link %LinkerFlags%
-    std::string compile_cmd = "cl.exe ";
+    command_args args = {compiler_program(conf)};
     for (auto s : targ.include_dirs) {
-        compile_cmd += "/I" + s + " ";
+        args.push_back("/I" + s);
     }
 
-    compile_cmd += compile_flags;
+    add_flags(args, compile_flags);
 
     switch (targ.warning_level) {
-        case 0: compile_cmd += "/W0 "; break;
-        case 1: compile_cmd += "/W1 "; break;
-        case 2: compile_cmd += "/W2 "; break;
-        case 3: compile_cmd += "/W3 "; break;
-        case 4: compile_cmd += "/W4 "; break;
+        case 0: args.push_back("/W0"); break;
+        case 1: args.push_back("/W1"); break;
+        case 2: args.push_back("/W2"); break;
+        case 3: args.push_back("/W3"); break;
+        case 4: args.push_back("/W4"); break;
     }
 
     if (targ.warnings_are_errors) {
-        compile_cmd += "/WX ";
+        args.push_back("/WX");
     }
 
     for (auto w : targ.warnings_to_ignore) {
-        compile_cmd += "/wd" + std::to_string(w) + " ";
+        args.push_back("/wd" + std::to_string(w));
     }
 
     for (auto d : conf.common_defines) {
-        compile_cmd += "/D" + d + " ";
+        args.push_back("/D" + d);
     }
     for (auto d : targ.defines) {
-        compile_cmd += "/D" + d + " ";
+        args.push_back("/D" + d);
     }
 
-    compile_cmd += src_file + " ";
+    // the pch source creates the precompiled header (/Yc), every other source uses it (/Yu)
+    if (targ.pch_header.size()) {
+        std::string header = absolute_path(targ.pch_header);
+        if (src_file == pch_source_file(conf, targ)) args.push_back("/Yc" + header);
+        else                                         args.push_back("/Yu" + header);
+        args.push_back("/FI" + header);
+        args.push_back("/Fp" + pch_file(conf, targ));
+    }
+
+    args.push_back(src_file);
 
-    compile_cmd += "/Fo: " + conf.obj_dir + "\\ ";
+    args.push_back("/Fo:");
+    args.push_back(target_obj_dir(conf, targ) + "\\");
 
-    return compile_cmd;
+    return args;
 }
 
-std::string generate_link_cmd(const project_config& conf, const target_config& targ) {
-    // start building options into flag strings 
+command_args generate_link_cmd(const project_config& conf, const target_config& targ) {
+    if (gnu_toolchain(conf)) return gnu_link_cmd(conf, targ);
+
+    // start building options into flag strings
     std::string default_flags = "/nologo /Gm- /GR- /EHa- /FC ";
 
     std::string std_cmd = "/std:c++" + std::to_string(conf.cpp_standard) + " ";
@@ -281,11 +956,12 @@ std::string generate_link_cmd(const project_config& conf, const target_config& t
     std::string compile_flags = default_flags + msvc_link + opt_cmd + std_cmd;
     if (conf.generate_debug_info) compile_flags += "/Z7 ";
     if (targ.type == shared_lib) compile_flags += "/LD ";
+    if (conf.lto != lto_none || conf.pgo != pgo_off) compile_flags += "/GL ";
 
 
 
     std::string link_flags = "/link ";
-    
+
     if (conf.incremental_link) link_flags += "/INCREMENTAL ";
     else                       link_flags += "/INCREMENTAL:NO ";
 
@@ -296,422 +972,4884 @@ std::string generate_link_cmd(const project_config& conf, const target_config& t
     for (auto & c: subsystem) c = toupper(c);
     link_flags += "/SUBSYSTEM:" + subsystem + " ";
 
-    if (targ.link_dir.size()) link_flags += "/LIBPATH:\"" + targ.link_dir + "\" ";
-
-    for (auto l : targ.link_libs) {
-        link_flags += l + " ";
-    }
-
     // assemble full command
     // cl %IncludeDirs% %CompilerFlags% %SrcFiles% /Fe: %OutputName% /Fo: %obj_dir% /link %LinkerFlags%
-    std::string compile_cmd = "cl.exe ";
+    command_args args = {compiler_program(conf)};
     for (auto s : targ.include_dirs) {
-        compile_cmd += "/I" + s + " ";
+        args.push_back("/I" + s);
     }
 
-    compile_cmd += compile_flags;
+    add_flags(args, compile_flags);
 
     switch (targ.warning_level) {
-        case 0: compile_cmd += "/W0 "; break;
-        case 1: compile_cmd += "/W1 "; break;
-        case 2: compile_cmd += "/W2 "; break;
-        case 3: compile_cmd += "/W3 "; break;
-        case 4: compile_cmd += "/W4 "; break;
+        case 0: args.push_back("/W0"); break;
+        case 1: args.push_back("/W1"); break;
+        case 2: args.push_back("/W2"); break;
+        case 3: args.push_back("/W3"); break;
+        case 4: args.push_back("/W4"); break;
     }
 
     if (targ.warnings_are_errors) {
-        compile_cmd += "/WX ";
+        args.push_back("/WX");
     }
 
     for (auto w : targ.warnings_to_ignore) {
-        compile_cmd += "/wd" + std::to_string(w) + " ";
+        args.push_back("/wd" + std::to_string(w));
     }
 
     for (auto d : conf.common_defines) {
-        compile_cmd += "/D" + d + " ";
+        args.push_back("/D" + d);
     }
     for (auto d : targ.defines) {
-        compile_cmd += "/D" + d + " ";
+        args.push_back("/D" + d);
     }
 
     for (auto s : targ.src_files) {
-        size_t last_slash = s.find_last_of('\\')+1;
-        size_t last_dot   = s.find_last_of('.');
-        std::string obj_name = s.substr(last_slash, last_dot - last_slash) + ".obj";
-        compile_cmd += conf.obj_dir + '\\' + obj_name + " ";
+        args.push_back(obj_file_for(conf, targ, s));
     }
+    if (targ.pch_header.size()) {
+        args.push_back(obj_file_for(conf, targ, pch_source_file(conf, targ)));
+    }
+
 
+    args.push_back("/Fe:");
+    args.push_back(conf.bin_dir + "\\" + targ.target_name);
+    args.push_back("/Fo:");
+    args.push_back(target_obj_dir(conf, targ) + "\\");
 
-    compile_cmd += "/Fe: " + conf.bin_dir + "\\" + targ.target_name + " ";
-    compile_cmd += "/Fo: " + conf.obj_dir + "\\ ";
+    add_flags(args, link_flags);
+    msvc_ltcg_flags(conf, targ, args);
 
-    compile_cmd += link_flags;
+    if (targ.link_dir.size()) args.push_back("/LIBPATH:" + targ.link_dir);
+
+    for (auto l : targ.link_libs) {
+        args.push_back(l);
+    }
 
-    return compile_cmd;
+    return args;
 }
 
-void ensure_output_dirs(const project_config& conf) {
+// create dir, and any of its parents that don't exist yet
+void make_dirs(const std::string& dir) {
+#ifdef _WIN32
     char full_path[MAX_PATH];
     WIN32_FIND_DATA data;
-    HANDLE hFind;
 
-    // bin dir
-    GetFullPathNameA(conf.bin_dir.c_str(), MAX_PATH, full_path, NULL);
-    hFind = FindFirstFile(full_path, &data);
+    GetFullPathNameA(dir.c_str(), MAX_PATH, full_path, NULL);
+    HANDLE hFind = FindFirstFile(full_path, &data);
     if (hFind == INVALID_HANDLE_VALUE) {
-        //CreateDirectory(full_path, NULL);
         SHCreateDirectoryExA(NULL, full_path, NULL);
+    } else {
+        FindClose(hFind);
+    }
+#else
+    for (size_t n = 1; n <= dir.size(); n++) {
+        if (n == dir.size() || dir[n] == '/') mkdir(dir.substr(0, n).c_str(), 0755);
     }
+#endif
+}
 
-    // obj dir
-    GetFullPathNameA(conf.obj_dir.c_str(), MAX_PATH, full_path, NULL);
-    hFind = FindFirstFile(full_path, &data);
-    if (hFind == INVALID_HANDLE_VALUE) {
-        //CreateDirectory(full_path, NULL);
-        SHCreateDirectoryExA(NULL, full_path, NULL);
+void ensure_output_dirs(const project_config& conf) {
+    make_dirs(conf.bin_dir);
+    make_dirs(conf.obj_dir);
+
+    // object cache
+    if (conf.object_cache_dir.size()) {
+        make_dirs(conf.object_cache_dir);
     }
 
-    // pre dir
-    GetFullPathNameA(conf.obj_dir.c_str(), MAX_PATH, full_path, NULL);
-    hFind = FindFirstFile(full_path, &data);
-    if (hFind == INVALID_HANDLE_VALUE) {
-        //CreateDirectory(full_path, NULL);
-        SHCreateDirectoryExA(NULL, full_path, NULL);
+    if (conf.lto_cache_dir.size()) {
+        make_dirs(conf.lto_cache_dir);
+    }
+    if (conf.pgo != pgo_off) {
+        make_dirs(pgo_raw_dir(conf));
     }
 
-    bool done = true;
+    // per-target obj dirs
+    for (const auto& targ : conf.targets) {
+        make_dirs(target_obj_dir(conf, targ));
+    }
 }
 
-std::string ReadFromPipe(HANDLE read_from)  { 
-    const size_t BUF_SIZE = 2048;
+/* child processes.
+* a process_group starts any number of children and drains all of their stdout/stderr pipes
+* from the one thread that calls run()/step(): poll() on posix, an I/O completion port on windows.
+* both pipes of a child are read as data shows up, so a compiler that fills its stderr pipe
+* can't stall while we are still waiting on stdout.
+*/
+struct process_result {
+    int exit_code = -1;
+    std::string std_out; // stays empty when stdout went to an output_sink
+    std::string std_err;
+    uint64 peak_rss_kb = 0; // the most memory the child had resident at once
+};
 
-    // Read output from the child process's pipe for STDOUT
-    // and write to the parent process's pipe for STDOUT. 
-    // Stop when there is no more data. 
-    DWORD dwRead; 
-    CHAR chBuf[BUF_SIZE]; 
-    BOOL bSuccess = FALSE;
+typedef std::function<void(process_result& result)> exit_handler;
+
+struct child_pipe {
+#ifdef _WIN32
+    HANDLE handle = INVALID_HANDLE_VALUE;
+    OVERLAPPED ov;
+#else
+    int fd = -1;
+#endif
+    bool open = false;
+    std::vector<char> buf;
+};
 
-    std::string output;
-    for (;;) { 
-        bSuccess = ReadFile( read_from, chBuf, BUF_SIZE, &dwRead, NULL);
-        if( ! bSuccess || dwRead == 0 ) break; 
+struct child_process {
+    output_sink on_stdout; // empty -> collect into result.std_out
+    exit_handler on_exit;
+    process_result result;
+    child_pipe out, err;
+#ifdef _WIN32
+    HANDLE process = NULL;
+#else
+    pid_t pid = -1;
+#endif
+};
 
-        output += std::string(chBuf, dwRead);
-    } 
+const size_t PIPE_BUF_SIZE = 64 * 1024;
 
-    return output;
-} 
+void deliver_output(child_process& child, child_pipe& pipe, const char* data, size_t len) {
+    if (&pipe == &child.err)   child.result.std_err.append(data, len);
+    else if (child.on_stdout)  child.on_stdout(data, len);
+    else                       child.result.std_out.append(data, len);
+}
 
-int run_command(const std::string& cmd, std::string& std_out, std::string& std_err) {
-    HANDLE STDOUT_Read  = NULL;
-    HANDLE STDOUT_Write = NULL;
-    HANDLE STDERR_Read  = NULL;
-    HANDLE STDERR_Write = NULL;
+#ifdef _WIN32
+// quote one argument so the MSVC runtime splits the command line back into the same argv
+void append_windows_arg(std::string& cmd_line, const std::string& arg) {
+    if (cmd_line.size()) cmd_line += ' ';
+    if (arg.size() && arg.find_first_of(" \t\n\v\"") == std::string::npos) {
+        cmd_line += arg;
+        return;
+    }
 
-    // Set the bInheritHandle flag so pipe handles are inherited. 
-    SECURITY_ATTRIBUTES saAttr; 
-    saAttr.nLength = sizeof(SECURITY_ATTRIBUTES); 
-    saAttr.bInheritHandle = TRUE; 
-    saAttr.lpSecurityDescriptor = NULL;
+    cmd_line += '"';
+    size_t slashes = 0;
+    for (char c : arg) {
+        if (c == '\\') {
+            slashes++;
+            continue;
+        }
+        // backslashes are only special right before a quote
+        if (c == '"') cmd_line.append(slashes*2 + 1, '\\');
+        else          cmd_line.append(slashes, '\\');
+        slashes = 0;
+        cmd_line += c;
+    }
+    cmd_line.append(slashes*2, '\\');
+    cmd_line += '"';
+}
 
-    // Create a pipe for the child process's STDOUT. 
-    if (!CreatePipe(&STDOUT_Read, &STDOUT_Write, &saAttr, 0)) {
-        return -1;
+std::atomic<unsigned int> pipe_serial(0);
+
+// anonymous pipes can't do overlapped reads, so use a uniquely named pipe instead.
+// `write_end` is inheritable and goes to the child.
+bool open_child_pipe(child_pipe& pipe, HANDLE port, child_process* owner, HANDLE& write_end) {
+    char name[64];
+    snprintf(name, sizeof(name), "\\\\.\\pipe\\build-%lu-%u", (unsigned long)GetCurrentProcessId(), pipe_serial++);
+    pipe.handle = CreateNamedPipeA(name, PIPE_ACCESS_INBOUND | FILE_FLAG_OVERLAPPED | FILE_FLAG_FIRST_PIPE_INSTANCE,
+                                   PIPE_TYPE_BYTE | PIPE_WAIT | PIPE_REJECT_REMOTE_CLIENTS,
+                                   1, PIPE_BUF_SIZE, PIPE_BUF_SIZE, 0, NULL);
+    if (pipe.handle == INVALID_HANDLE_VALUE) return false;
+
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(sa);
+    sa.bInheritHandle = TRUE;
+    sa.lpSecurityDescriptor = NULL;
+    write_end = CreateFileA(name, GENERIC_WRITE, 0, &sa, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (write_end == INVALID_HANDLE_VALUE) {
+        CloseHandle(pipe.handle);
+        pipe.handle = INVALID_HANDLE_VALUE;
+        return false;
     }
-    // Ensure the read handle to the pipe for STDOUT is not inherited.
-    if (!SetHandleInformation(STDOUT_Read, HANDLE_FLAG_INHERIT, 0)) {
-        return -1;
+
+    CreateIoCompletionPort(pipe.handle, port, (ULONG_PTR)owner, 0);
+    pipe.buf.resize(PIPE_BUF_SIZE);
+    pipe.open = true;
+    return true;
+}
+
+void close_child_pipe(child_pipe& pipe) {
+    if (pipe.handle != INVALID_HANDLE_VALUE) CloseHandle(pipe.handle);
+    pipe.handle = INVALID_HANDLE_VALUE;
+    pipe.open = false;
+}
+
+// queue the next read. it completes through the port, even when ReadFile finishes right away.
+void start_pipe_read(child_pipe& pipe) {
+    ZeroMemory(&pipe.ov, sizeof(pipe.ov));
+    if (!ReadFile(pipe.handle, pipe.buf.data(), (DWORD)pipe.buf.size(), NULL, &pipe.ov)) {
+        if (GetLastError() != ERROR_IO_PENDING) close_child_pipe(pipe); // broken pipe: child closed its end
     }
+}
+#else
+extern char** environ;
+
+bool open_pipe(int fds[2]) {
+#ifdef __linux__
+    return pipe2(fds, O_CLOEXEC) == 0;
+#else
+    if (pipe(fds)) return false;
+    fcntl(fds[0], F_SETFD, FD_CLOEXEC);
+    fcntl(fds[1], F_SETFD, FD_CLOEXEC);
+    return true;
+#endif
+}
 
-    // Create a pipe for the child process's STDERR. 
-    if (!CreatePipe(&STDERR_Read, &STDERR_Write, &saAttr, 0)) {
-        return -1;
+void close_child_pipe(child_pipe& pipe) {
+    if (pipe.fd >= 0) close(pipe.fd);
+    pipe.fd = -1;
+    pipe.open = false;
+}
+#endif
+
+struct process_group {
+    std::vector<std::unique_ptr<child_process>> children;
+#ifdef _WIN32
+    HANDLE port = NULL;
+#else
+    int wake_fd = -1; // read end of a pipe that interrupts step(), see process_loop
+#endif
+    bool wait_idle = false; // step() blocks even without children, until something wakes it
+
+    process_group() {
+#ifdef _WIN32
+        port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 1);
+#endif
     }
-    // Ensure the read handle to the pipe for STDERR is not inherited.
-    if (!SetHandleInformation(STDERR_Read, HANDLE_FLAG_INHERIT, 0)) {
-        return -1;
+
+    ~process_group() {
+        run();
+#ifdef _WIN32
+        CloseHandle(port);
+#endif
     }
 
-    // Configure the child process
-    PROCESS_INFORMATION piProcInfo; 
-    STARTUPINFO siStartInfo;
-    BOOL bSuccess = FALSE; 
- 
-    ZeroMemory( &piProcInfo, sizeof(PROCESS_INFORMATION) );
- 
-    // Set up members of the STARTUPINFO structure. 
-    // This structure specifies the STDIN and STDOUT handles for redirection.
-    ZeroMemory( &siStartInfo, sizeof(STARTUPINFO) );
-    siStartInfo.cb = sizeof(STARTUPINFO); 
-    siStartInfo.hStdError = STDERR_Write;
-    siStartInfo.hStdOutput = STDOUT_Write;
-    siStartInfo.hStdInput = NULL;
-    siStartInfo.dwFlags |= STARTF_USESTDHANDLES;
-
-    // Create the child process. 
-    char* cmd_line = (char*)malloc(cmd.size() + 1);
-    strcpy(cmd_line, cmd.c_str());
-    cmd_line[cmd.size()] = 0;
-    bSuccess = CreateProcess(NULL, 
-                             cmd_line,      // command line 
-                             NULL,          // process security attributes 
-                             NULL,          // primary thread security attributes 
-                             TRUE,          // handles are inherited 
-                             0,             // creation flags 
-                             NULL,          // use parent's environment 
-                             NULL,          // use parent's current directory 
-                             &siStartInfo,  // STARTUPINFO pointer 
-                             &piProcInfo);  // receives PROCESS_INFORMATION 
-
-    // If an error occurs, exit the application. 
-    if (!bSuccess) {
-        return -1;
-    } else {
-        // Close handles to the child process and its primary thread.
-        // Some applications might keep these handles to monitor the status
-        // of the child process, for example. 
-        //CloseHandle(piProcInfo.hProcess);
-        //CloseHandle(piProcInfo.hThread);
-      
-        // Close handles to the stdin and stdout pipes no longer needed by the child process.
-        // If they are not explicitly closed, there is no way to recognize that the child process has ended.
-        CloseHandle(STDOUT_Write);
-        CloseHandle(STDERR_Write);
-    }
-
-    std_out = ReadFromPipe(STDOUT_Read);
-    std_err = ReadFromPipe(STDERR_Read);
-
-    // get the error code once its done
-    DWORD exit_code;
-    GetExitCodeProcess(piProcInfo.hProcess, &exit_code);
-    CloseHandle(piProcInfo.hProcess);
-    CloseHandle(piProcInfo.hThread);
+    size_t running() const { return children.size(); }
 
-    return exit_code;
-}
+    // start `args[0]` (looked up on PATH) with the rest as its arguments.
+    // on_exit is called from run()/step() once the child has exited and both pipes are drained.
+    bool spawn(const command_args& args, const output_sink& on_stdout, const exit_handler& on_exit);
 
-int build_project(const project_config& conf) {
-    int num_targets = conf.targets.size();
-    printf("Full Build [%s]: %d targets.\n", conf.project_name.c_str(), num_targets);
+    // wait for the next bit of output or exit, and handle it
+    void step();
 
-    ensure_output_dirs(conf);
+    // keep stepping until every child has finished
+    void run() {
+        while (children.size()) step();
+    }
 
-    for (int n = 0; n < num_targets; n++) {
-        const target_config& targ = conf.targets[n];
+    // remove children whose pipes are both closed, then report their exit codes
+    void reap();
+};
 
-        printf("  Generating build_cmd...");
-        std::string cmd = generate_target_build_cmd(conf, targ);
-        printf("Done.\n");
+#ifdef _WIN32
+bool process_group::spawn(const command_args& args, const output_sink& on_stdout, const exit_handler& on_exit) {
+    if (args.empty() || port == NULL) return false;
+
+    std::unique_ptr<child_process> child(new child_process);
+    child->on_stdout = on_stdout;
+    child->on_exit = on_exit;
+
+    HANDLE out_write = INVALID_HANDLE_VALUE;
+    HANDLE err_write = INVALID_HANDLE_VALUE;
+    if (!open_child_pipe(child->out, port, child.get(), out_write)) return false;
+    if (!open_child_pipe(child->err, port, child.get(), err_write)) {
+        CloseHandle(out_write);
+        close_child_pipe(child->out);
+        return false;
+    }
 
-        printf("    Building [%s]...", targ.target_name.c_str());
-        //int res = system(cmd.c_str());
+    SECURITY_ATTRIBUTES sa;
+    sa.nLength = sizeof(sa);
+    sa.bInheritHandle = TRUE;
+    sa.lpSecurityDescriptor = NULL;
+    HANDLE nul = CreateFileA("NUL", GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, &sa, OPEN_EXISTING, 0, NULL);
+
+    // only hand these three to the child. otherwise a child started at the same time on
+    // another thread could inherit our pipe ends too and keep them open past our child's exit.
+    HANDLE inherit[3] = { nul, out_write, err_write };
+    SIZE_T attr_size = 0;
+    InitializeProcThreadAttributeList(NULL, 1, 0, &attr_size);
+    std::vector<char> attr_buf(attr_size);
+    LPPROC_THREAD_ATTRIBUTE_LIST attrs = (LPPROC_THREAD_ATTRIBUTE_LIST)attr_buf.data();
+    InitializeProcThreadAttributeList(attrs, 1, 0, &attr_size);
+    UpdateProcThreadAttribute(attrs, 0, PROC_THREAD_ATTRIBUTE_HANDLE_LIST, inherit, sizeof(inherit), NULL, NULL);
+
+    STARTUPINFOEXA si;
+    ZeroMemory(&si, sizeof(si));
+    si.StartupInfo.cb = sizeof(si);
+    si.StartupInfo.hStdInput = nul;
+    si.StartupInfo.hStdOutput = out_write;
+    si.StartupInfo.hStdError = err_write;
+    si.StartupInfo.dwFlags |= STARTF_USESTDHANDLES;
+    si.lpAttributeList = attrs;
+
+    std::string cmd_line;
+    for (const auto& a : args) append_windows_arg(cmd_line, a);
+
+    PROCESS_INFORMATION pi;
+    ZeroMemory(&pi, sizeof(pi));
+    BOOL ok = CreateProcessA(NULL, &cmd_line[0], NULL, NULL, TRUE, EXTENDED_STARTUPINFO_PRESENT,
+                             NULL, NULL, &si.StartupInfo, &pi);
+
+    // the child has its own copies now. if we kept ours, the pipes would never report EOF.
+    DeleteProcThreadAttributeList(attrs);
+    if (nul != INVALID_HANDLE_VALUE) CloseHandle(nul);
+    CloseHandle(out_write);
+    CloseHandle(err_write);
+
+    if (!ok) {
+        close_child_pipe(child->out);
+        close_child_pipe(child->err);
+        return false;
+    }
 
-        std::string std_out, std_err;
-        int res = run_command(cmd, std_out, std_err);
+    CloseHandle(pi.hThread);
+    child->process = pi.hProcess;
 
-        if (res) {
-            printf("Failed! ErrorCode: %d\n", res);
-            printf("%s\n", std_out.c_str());
-            printf("%s\n", std_err.c_str());
-            return res;
-        }
+    start_pipe_read(child->out);
+    start_pipe_read(child->err);
+    children.push_back(std::move(child));
+    return true;
+}
 
-        printf("Done.\n");
+void process_group::step() {
+    // a child whose pipes broke straight away has nothing left in the port to wait for
+    reap();
+    if (children.empty() && !wait_idle) return;
+
+    DWORD bytes = 0;
+    ULONG_PTR key = 0;
+    OVERLAPPED* ov = NULL;
+    BOOL ok = GetQueuedCompletionStatus(port, &bytes, &key, &ov, INFINITE);
+    if (ov == NULL) return; // a wake-up (PostQueuedCompletionStatus without an OVERLAPPED)
+
+    child_process* child = (child_process*)key;
+    child_pipe& pipe = (ov == &child->out.ov) ? child->out : child->err;
+    if (ok) {
+        deliver_output(*child, pipe, pipe.buf.data(), bytes);
+        start_pipe_read(pipe);
+    } else {
+        close_child_pipe(pipe);
     }
 
-    return 0;
+    reap();
 }
 
-std::unordered_map<std::string, MSIFILEHASHINFO> file_hashes;
+void process_group::reap() {
+    for (size_t n = 0; n < children.size(); ) {
+        if (children[n]->out.open || children[n]->err.open) {
+            n++;
+            continue;
+        }
 
-void write_table(const project_config& conf, const std::string& target_name) {
-    std::string out_name = conf.obj_dir + "\\" + conf.project_name + "_" + target_name + ".table";
+        std::unique_ptr<child_process> child = std::move(children[n]);
+        children.erase(children.begin() + n);
 
-    FILE* fid = fopen(out_name.c_str(), "w");
-    if (fid) {
-        for (auto &kv : file_hashes) {
-            fprintf(fid, "%s, %u, %u, %u, %u\n",
-                    kv.first.c_str(),
-                    kv.second.dwData[0], kv.second.dwData[1], kv.second.dwData[2], kv.second.dwData[3]);
-        }
+        DWORD exit_code = (DWORD)-1;
+        WaitForSingleObject(child->process, INFINITE);
+        GetExitCodeProcess(child->process, &exit_code);
+        PROCESS_MEMORY_COUNTERS mem;
+        if (GetProcessMemoryInfo(child->process, &mem, sizeof(mem))) child->result.peak_rss_kb = mem.PeakWorkingSetSize / 1024;
+        CloseHandle(child->process);
 
-        fclose(fid);
+        child->result.exit_code = (int)exit_code;
+        if (child->on_exit) child->on_exit(child->result);
     }
 }
-void read_table(const project_config& conf, const std::string& target_name) {
-    file_hashes.clear();
+#else
+bool process_group::spawn(const command_args& args, const output_sink& on_stdout, const exit_handler& on_exit) {
+    if (args.empty()) return false;
+
+    int out_fds[2], err_fds[2];
+    if (!open_pipe(out_fds)) return false;
+    if (!open_pipe(err_fds)) {
+        close(out_fds[0]);
+        close(out_fds[1]);
+        return false;
+    }
 
-    std::string in_name = conf.obj_dir + "\\" + conf.project_name + "_" + target_name + ".table";
+    // dup2 clears close-on-exec on the child's copies, everything else we opened stays out of it
+    posix_spawn_file_actions_t actions;
+    posix_spawn_file_actions_init(&actions);
+    posix_spawn_file_actions_addopen(&actions, 0, "/dev/null", O_RDONLY, 0);
+    posix_spawn_file_actions_adddup2(&actions, out_fds[1], 1);
+    posix_spawn_file_actions_adddup2(&actions, err_fds[1], 2);
+
+    std::vector<char*> argv;
+    for (const auto& a : args) argv.push_back((char*)a.c_str());
+    argv.push_back(nullptr);
+
+    pid_t pid;
+    int res = posix_spawnp(&pid, argv[0], &actions, NULL, argv.data(), environ);
+    posix_spawn_file_actions_destroy(&actions);
+
+    close(out_fds[1]);
+    close(err_fds[1]);
+    if (res) {
+        close(out_fds[0]);
+        close(err_fds[0]);
+        return false;
+    }
 
-    std::ifstream fid;
-    fid.open(in_name);
-    if (fid.is_open()) {
-        std::string line;
+    std::unique_ptr<child_process> child(new child_process);
+    child->on_stdout = on_stdout;
+    child->on_exit = on_exit;
+    child->pid = pid;
+    child->out.fd = out_fds[0];
+    child->err.fd = err_fds[0];
+    for (child_pipe* pipe : { &child->out, &child->err }) {
+        fcntl(pipe->fd, F_SETFL, fcntl(pipe->fd, F_GETFL) | O_NONBLOCK);
+        pipe->buf.resize(PIPE_BUF_SIZE);
+        pipe->open = true;
+    }
+
+    children.push_back(std::move(child));
+    return true;
+}
+
+void process_group::step() {
+    if (children.empty() && !wait_idle) return;
+
+    std::vector<pollfd> fds;
+    std::vector<std::pair<child_process*, child_pipe*>> owners;
+    if (wake_fd >= 0) {
+        pollfd p;
+        p.fd = wake_fd;
+        p.events = POLLIN;
+        p.revents = 0;
+        fds.push_back(p);
+        owners.push_back(std::make_pair(nullptr, nullptr));
+    }
+    for (auto& child : children) {
+        for (child_pipe* pipe : { &child->out, &child->err }) {
+            if (!pipe->open) continue;
+            pollfd p;
+            p.fd = pipe->fd;
+            p.events = POLLIN;
+            p.revents = 0;
+            fds.push_back(p);
+            owners.push_back(std::make_pair(child.get(), pipe));
+        }
+    }
+
+    if (poll(fds.data(), fds.size(), -1) < 0) {
+        if (errno == EINTR) return;
+        // nothing sensible left to wait on, treat every pipe as closed
+        for (auto& o : owners) {
+            if (o.second) close_child_pipe(*o.second);
+        }
+    }
+
+    for (size_t n = 0; n < fds.size(); n++) {
+        if (fds[n].revents == 0) continue;
+        if (!owners[n].second) {
+            char drain[64];
+            while (read(wake_fd, drain, sizeof(drain)) > 0) {}
+            continue;
+        }
+
+        // one read per wakeup, so a chatty child can't starve the others
+        child_pipe& pipe = *owners[n].second;
+        ssize_t got = read(pipe.fd, pipe.buf.data(), pipe.buf.size());
+        if (got > 0) {
+            deliver_output(*owners[n].first, pipe, pipe.buf.data(), (size_t)got);
+        } else if (got == 0 || (errno != EAGAIN && errno != EINTR)) {
+            close_child_pipe(pipe);
+        }
+    }
+
+    reap();
+}
+
+void process_group::reap() {
+    for (size_t n = 0; n < children.size(); ) {
+        if (children[n]->out.open || children[n]->err.open) {
+            n++;
+            continue;
+        }
+
+        std::unique_ptr<child_process> child = std::move(children[n]);
+        children.erase(children.begin() + n);
+
+        int status = 0;
+        rusage usage = {};
+        while (wait4(child->pid, &status, 0, &usage) < 0 && errno == EINTR) {}
+#ifdef __APPLE__
+        child->result.peak_rss_kb = (uint64)usage.ru_maxrss / 1024; // bytes there, KB on linux
+#else
+        child->result.peak_rss_kb = (uint64)usage.ru_maxrss;
+#endif
+
+        if (WIFEXITED(status))        child->result.exit_code = WEXITSTATUS(status);
+        else if (WIFSIGNALED(status)) child->result.exit_code = 128 + WTERMSIG(status);
+
+        if (child->on_exit) child->on_exit(child->result);
+    }
+}
+#endif
+
+/* the one event loop every run_command child runs on.
+* a single thread owns a process_group and drains the pipes of all children with its poll() /
+* completion port, the way build_project drives its own group. run_command hands it the spawn and
+* waits for the exit handler, so a job_pool thread running a compile does no I/O of its own.
+*/
+struct process_loop {
+    std::mutex lock;
+    std::deque<std::function<void()>> pending; // run on the loop thread, between steps
+    process_group group;
+#ifndef _WIN32
+    int wake_write = -1;
+#endif
+
+    process_loop() {
+        group.wait_idle = true;
+#ifndef _WIN32
+        int fds[2];
+        if (open_pipe(fds)) {
+            fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[1], F_SETFL, fcntl(fds[1], F_GETFL) | O_NONBLOCK);
+            group.wake_fd = fds[0];
+            wake_write = fds[1];
+        }
+#endif
+        std::thread([this]() { loop(); }).detach();
+    }
+
+    void submit(std::function<void()> fn) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            pending.push_back(std::move(fn));
+        }
+#ifdef _WIN32
+        PostQueuedCompletionStatus(group.port, 0, 0, NULL);
+#else
+        char c = 1;
+        if (write(wake_write, &c, 1) < 0) {} // a full pipe already wakes it
+#endif
+    }
+
+    void loop() {
+        for (;;) {
+            std::deque<std::function<void()>> work;
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                work.swap(pending);
+            }
+            for (auto& fn : work) fn();
+            group.step();
+        }
+    }
+};
+
+// never destroyed, its thread runs until the process exits
+process_loop& shared_process_loop() {
+    static process_loop* loop = new process_loop;
+    return *loop;
+}
+
+int run_command_impl(const command_args& args, const output_sink* on_stdout, std::string& std_out, std::string& std_err, uint64* peak_rss_kb = nullptr) {
+    std::mutex done_lock;
+    std::condition_variable done_cv;
+    bool done = false;
+    bool started = false;
+    int exit_code = -1;
+
+    process_loop& loop = shared_process_loop();
+    loop.submit([&]() {
+        started = loop.group.spawn(args, on_stdout ? *on_stdout : output_sink(), [&](process_result& res) {
+            exit_code = res.exit_code;
+            if (peak_rss_kb) *peak_rss_kb = res.peak_rss_kb;
+            std_out.swap(res.std_out);
+            std_err.swap(res.std_err);
+
+            std::lock_guard<std::mutex> guard(done_lock);
+            done = true;
+            done_cv.notify_all();
+        });
+        if (!started) {
+            std::lock_guard<std::mutex> guard(done_lock);
+            done = true;
+            done_cv.notify_all();
+        }
+    });
+
+    std::unique_lock<std::mutex> guard(done_lock);
+    done_cv.wait(guard, [&]() { return done; });
+
+    if (!started) {
+        std_err = "could not start " + (args.size() ? args[0] : std::string("<empty command>")) + "\n";
+        return -1;
+    }
+    return exit_code;
+}
+
+int run_command(const command_args& args, std::string& std_out, std::string& std_err) {
+    return run_command_impl(args, nullptr, std_out, std_err);
+}
+
+// also reports the child's peak resident memory
+int run_command(const command_args& args, std::string& std_out, std::string& std_err, uint64& peak_rss_kb) {
+    return run_command_impl(args, nullptr, std_out, std_err, &peak_rss_kb);
+}
+
+// like run_command, but stdout is passed to `on_stdout` in chunks instead of being collected
+int run_command_streamed(const command_args& args, const output_sink& on_stdout, std::string& std_err) {
+    std::string unused;
+    return run_command_impl(args, &on_stdout, unused, std_err);
+}
+
+/* a fixed set of worker threads that run submitted jobs in FIFO order.
+* wait() blocks until every submitted job has finished.
+*/
+struct job_pool {
+    std::vector<std::thread> workers;
+    std::deque<std::function<void()>> queue;
+    std::mutex lock;
+    std::condition_variable work_available;
+    std::condition_variable work_done;
+    unsigned int active = 0;
+    bool stopping = false;
+
+    job_pool(unsigned int num_workers) {
+        if (num_workers == 0) num_workers = 1;
+        for (unsigned int n = 0; n < num_workers; n++) {
+            workers.emplace_back([this]() { worker_loop(); });
+        }
+    }
+
+    ~job_pool() {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            stopping = true;
+        }
+        work_available.notify_all();
+        for (auto& t : workers) t.join();
+    }
+
+    void submit(std::function<void()> job) {
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            queue.push_back(std::move(job));
+        }
+        work_available.notify_one();
+    }
+
+    void wait() {
+        std::unique_lock<std::mutex> guard(lock);
+        work_done.wait(guard, [this]() { return queue.empty() && active == 0; });
+    }
+
+    void worker_loop() {
+        for (;;) {
+            std::function<void()> job;
+            {
+                std::unique_lock<std::mutex> guard(lock);
+                work_available.wait(guard, [this]() { return stopping || !queue.empty(); });
+                if (queue.empty()) return; // stopping
+
+                job = std::move(queue.front());
+                queue.pop_front();
+                active++;
+            }
+
+            job();
+
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                active--;
+            }
+            work_done.notify_all();
+        }
+    }
+};
+
+// jobs finish in any order, so each one collects its output
+// and prints it in one go to keep lines from interleaving
+std::mutex print_lock;
+void print_locked(const std::string& text) {
+    std::lock_guard<std::mutex> guard(print_lock);
+    fputs(text.c_str(), stdout);
+    fflush(stdout);
+}
+
+std::string format_str(const char* fmt, ...) {
+    char buf[1024];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len < 0) return "";
+    if (len < (int)sizeof(buf)) return std::string(buf, len);
+
+    std::string big(len, 0);
+    va_start(args, fmt);
+    vsnprintf(&big[0], len + 1, fmt, args);
+    va_end(args);
+    return big;
+}
+
+/* build timeline (opt-in, see project_config::trace_file).
+* every action becomes one complete ("X") event of the chrome trace_event format.
+* timestamps are steady_clock microseconds, which all processes on a machine share,
+* so the self-rebuild of the previous build.exe lines up with the build it started.
+* with tracing off, a trace_scope is a single branch.
+*/
+struct trace_event {
+    const char* kind; // preprocess, hash, compile, remote, cache, link, build, self-rebuild
+    std::string name; // the file or target it was for
+    uint64 start_us;
+    uint64 dur_us;
+    uint32_t slot;    // worker thread, or process slot in build_project
+    int exit_code;
+};
+
+struct trace_recorder {
+    std::atomic<bool> enabled{false};
+    std::mutex lock;
+    std::vector<trace_event> events;
+};
+trace_recorder build_trace;
+
+// the self-rebuild happens in the previous process, which hands its timing over in this variable
+static const char* trace_rebuild_env = "BUILD_TRACE_SELF_REBUILD";
+
+uint64 trace_now_us() {
+    return (uint64)std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+// a small stable number per thread, so the timeline shows one row per worker
+uint32_t trace_thread_slot() {
+    static std::atomic<uint32_t> next_slot(0);
+    static thread_local uint32_t slot = next_slot++;
+    return slot;
+}
+
+void trace_record(const char* kind, const std::string& name, uint64 start_us, uint64 end_us, uint32_t slot, int exit_code) {
+    if (!build_trace.enabled.load(std::memory_order_relaxed)) return;
+
+    trace_event e;
+    e.kind = kind;
+    e.name = name;
+    e.start_us = start_us;
+    e.dur_us = end_us > start_us ? end_us - start_us : 0;
+    e.slot = slot;
+    e.exit_code = exit_code;
+
+    std::lock_guard<std::mutex> guard(build_trace.lock);
+    build_trace.events.push_back(e);
+}
+
+// times the enclosing block on the current thread. set exit_code before it ends if the action failed
+struct trace_scope {
+    const char* kind;
+    const std::string* name;
+    uint64 start_us = 0;
+    int exit_code = 0;
+
+    trace_scope(const char* kind, const std::string& name) : kind(kind), name(&name) {
+        if (build_trace.enabled.load(std::memory_order_relaxed)) start_us = trace_now_us();
+    }
+
+    ~trace_scope() {
+        if (start_us) trace_record(kind, *name, start_us, trace_now_us(), trace_thread_slot(), exit_code);
+    }
+};
+
+void set_env(const char* name, const std::string& value) {
+#ifdef _WIN32
+    SetEnvironmentVariableA(name, value.c_str());
+#else
+    setenv(name, value.c_str(), 1);
+#endif
+}
+
+/* GNU make jobserver.
+* the tokens are bytes in a pipe or a fifo (a named semaphore on windows), one for every job that may run
+* on top of the one each process gets for free. a compile or link takes a token before it starts and
+* puts the same byte back when it ends.
+* under make (MAKEFLAGS has --jobserver-auth) the tokens come from make, so the -j given at the top caps
+* the whole process tree. otherwise the build serves max_jobs - 1 tokens itself, takes its own jobs from
+* them, and passes them on in MAKEFLAGS to what it runs: nested build-scripts, make, gcc's -flto=auto.
+*/
+struct jobserver_state {
+    std::mutex lock;
+    std::condition_variable changed;
+    bool active = false;
+    bool serving = false;
+    bool implicit_free = true; // the token we didn't have to take
+    bool reading = false;      // one thread waits on the jobserver, the others on `changed`
+    std::string auth;          // what follows --jobserver-auth=
+#ifdef _WIN32
+    HANDLE sem = NULL;
+#else
+    int read_fd = -1;
+    int write_fd = -1;
+    std::string fifo_path;     // removed at exit, when serving a fifo
+#endif
+};
+
+jobserver_state jobserver;
+
+struct job_token {
+    bool held = false; // a token from the jobserver, to give back
+    bool implicit = false;
+    char byte = '+';
+};
+
+#ifndef _WIN32
+void jobserver_remove_fifo() {
+    unlink(jobserver.fifo_path.c_str());
+}
+
+bool fd_is_open(int fd) {
+    return fd >= 0 && fcntl(fd, F_GETFD) != -1;
+}
+#endif
+
+// the value of the last --jobserver-auth= (or the older --jobserver-fds=) in MAKEFLAGS
+std::string jobserver_auth_from_env() {
+    const char* flags = getenv("MAKEFLAGS");
+    if (!flags) return "";
+
+    std::string auth;
+    const char* keys[] = { "--jobserver-auth=", "--jobserver-fds=" };
+    for (const char* key : keys) {
+        std::string str = flags;
+        for (size_t at = str.find(key); at != std::string::npos; at = str.find(key, at + 1)) {
+            size_t start = at + strlen(key);
+            auth = str.substr(start, str.find_first_of(" \t", start) - start);
+        }
+        if (auth.size()) break;
+    }
+    return auth;
+}
+
+bool jobserver_connect(const std::string& auth) {
+#ifdef _WIN32
+    jobserver.sem = OpenSemaphoreA(SYNCHRONIZE | SEMAPHORE_MODIFY_STATE, FALSE, auth.c_str());
+    return jobserver.sem != NULL;
+#else
+    if (auth.compare(0, 5, "fifo:") == 0) {
+        jobserver.read_fd = open(auth.c_str() + 5, O_RDWR | O_CLOEXEC);
+        jobserver.write_fd = jobserver.read_fd;
+        return jobserver.read_fd >= 0;
+    }
+
+    // "R,W": fds inherited from make, only there if make knew it ran a sub-make (a `+` rule, or $(MAKE) in it)
+    int r = -1, w = -1;
+    if (sscanf(auth.c_str(), "%d,%d", &r, &w) != 2 || !fd_is_open(r) || !fd_is_open(w)) return false;
+    jobserver.read_fd = r;
+    jobserver.write_fd = w;
+    return true;
+#endif
+}
+
+bool jobserver_serve(unsigned int tokens, bool use_fifo) {
+#ifdef _WIN32
+    (void)use_fifo;
+    std::string name = format_str("build_jobserver_%lu", (unsigned long)GetCurrentProcessId());
+    jobserver.sem = CreateSemaphoreA(NULL, tokens, (std::max)(tokens, 1u), name.c_str());
+    if (!jobserver.sem) return false;
+    jobserver.auth = name;
+#else
+    if (use_fifo) {
+        const char* tmp = getenv("TMPDIR");
+        jobserver.fifo_path = format_str("%s/build_jobserver_%d", tmp ? tmp : "/tmp", (int)getpid());
+        unlink(jobserver.fifo_path.c_str());
+        if (mkfifo(jobserver.fifo_path.c_str(), 0600) != 0) return false;
+        atexit(jobserver_remove_fifo);
+
+        jobserver.read_fd = open(jobserver.fifo_path.c_str(), O_RDWR | O_CLOEXEC);
+        jobserver.write_fd = jobserver.read_fd;
+        jobserver.auth = "fifo:" + jobserver.fifo_path;
+    } else {
+        // no O_CLOEXEC, the children inherit the fds
+        int fds[2];
+        if (pipe(fds) != 0) return false;
+        jobserver.read_fd = fds[0];
+        jobserver.write_fd = fds[1];
+        jobserver.auth = format_str("%d,%d", fds[0], fds[1]);
+    }
+    if (jobserver.read_fd < 0) return false;
+
+    std::string bytes(tokens, '+');
+    if (bytes.size() && write(jobserver.write_fd, bytes.data(), bytes.size()) != (ssize_t)bytes.size()) return false;
+#endif
+
+    // what make would pass on: the job count and where the tokens are
+    const char* old_flags = getenv("MAKEFLAGS");
+    std::string flags = old_flags ? std::string(old_flags) + " " : "";
+    set_env("MAKEFLAGS", flags + format_str("-j%u --jobserver-auth=", tokens + 1) + jobserver.auth);
+    return true;
+}
+
+// join make's jobserver, or start one for the tools the build runs. once per process
+void jobserver_init(const project_config& conf) {
+    static std::once_flag once;
+    std::call_once(once, [&conf]() {
+        std::string auth = jobserver_auth_from_env();
+        if (auth.size()) {
+            if (jobserver_connect(auth)) {
+                jobserver.auth = auth;
+                jobserver.active = true;
+            } else {
+                printf("    MAKEFLAGS has a jobserver, but it can't be opened (is the rule marked with `+`?). Ignoring it.\n");
+            }
+            return;
+        }
+
+        if (!conf.use_jobserver) return;
+        jobserver.active = jobserver_serve(get_job_count(conf) - 1, conf.jobserver_fifo);
+        jobserver.serving = jobserver.active;
+    });
+}
+
+// one token from the jobserver, timeout_ms 0 only tries. -1 if none came, -2 if the jobserver is gone
+int jobserver_read(int timeout_ms) {
+#ifdef _WIN32
+    DWORD res = WaitForSingleObject(jobserver.sem, timeout_ms);
+    if (res == WAIT_OBJECT_0) return '+';
+    return res == WAIT_TIMEOUT ? -1 : -2;
+#else
+    pollfd p = {};
+    p.fd = jobserver.read_fd;
+    p.events = POLLIN;
+    int ready = poll(&p, 1, timeout_ms);
+    if (ready <= 0) return ready < 0 && errno != EINTR ? -2 : -1;
+
+    // another process can get to the byte first, then this waits for the next one
+    unsigned char c;
+    ssize_t got = read(jobserver.read_fd, &c, 1);
+    if (got == 1) return c;
+    return got < 0 && (errno == EAGAIN || errno == EINTR) ? -1 : -2;
+#endif
+}
+
+// false only if `wait` is false and no token is free. without a jobserver every job may run
+bool jobserver_acquire(job_token& token, bool wait = true) {
+    token = job_token();
+    if (!jobserver.active) return true;
+
+    std::unique_lock<std::mutex> guard(jobserver.lock);
+    while (true) {
+        if (jobserver.implicit_free) {
+            jobserver.implicit_free = false;
+            token.implicit = true;
+            return true;
+        }
+
+        if (!jobserver.reading) {
+            jobserver.reading = true;
+            guard.unlock();
+            // short waits, so the implicit token coming back is noticed
+            int c = jobserver_read(wait ? 100 : 0);
+            guard.lock();
+            jobserver.reading = false;
+            jobserver.changed.notify_all();
+
+            if (c >= 0) {
+                token.held = true;
+                token.byte = (char)c;
+                return true;
+            }
+            if (c == -2) {
+                jobserver.active = false; // the jobserver went away, don't hold up the build
+                return true;
+            }
+        } else if (wait) {
+            jobserver.changed.wait(guard);
+            continue;
+        }
+        if (!wait) return false;
+    }
+}
+
+void jobserver_release(job_token& token) {
+    if (token.implicit) {
+        std::lock_guard<std::mutex> guard(jobserver.lock);
+        jobserver.implicit_free = true;
+        jobserver.changed.notify_all();
+    } else if (token.held) {
+#ifdef _WIN32
+        ReleaseSemaphore(jobserver.sem, 1, NULL);
+#else
+        while (write(jobserver.write_fd, &token.byte, 1) < 0 && errno == EINTR) {}
+#endif
+    }
+    token = job_token();
+}
+
+// start recording if the project asks for it
+void trace_begin(const project_config& conf) {
+    {
+        std::lock_guard<std::mutex> guard(build_trace.lock);
+        build_trace.events.clear();
+    }
+    build_trace.enabled = conf.trace_file.size() > 0;
+    if (!build_trace.enabled) return;
+
+    const char* rebuild = getenv(trace_rebuild_env);
+    unsigned long long start_us = 0, end_us = 0;
+    int exit_code = 0;
+    if (rebuild && sscanf(rebuild, "%llu %llu %d", &start_us, &end_us, &exit_code) == 3) {
+        trace_record("self-rebuild", "build.exe", start_us, end_us, trace_thread_slot(), exit_code);
+    }
+}
+
+std::string json_escape(const std::string& str) {
+    std::string out;
+    for (char c : str) {
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if ((unsigned char)c < 0x20) {
+            out += format_str("\\u%04x", (unsigned int)c);
+        } else {
+            out += c;
+        }
+    }
+    return out;
+}
+
+// write everything recorded since trace_begin, then stop recording
+bool trace_end(const project_config& conf) {
+    if (!build_trace.enabled) return true;
+    build_trace.enabled = false;
+
+    std::lock_guard<std::mutex> guard(build_trace.lock);
+    FILE* fid = fopen(conf.trace_file.c_str(), "wb");
+    if (!fid) {
+        printf("    failed to write trace [%s]\n", conf.trace_file.c_str());
+        return false;
+    }
+
+    uint32_t max_slot = 0;
+    fprintf(fid, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+    fprintf(fid, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"%s\"}}",
+            json_escape(conf.project_name).c_str());
+    for (const auto& e : build_trace.events) {
+        fprintf(fid, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%llu,\"dur\":%llu,\"pid\":1,\"tid\":%u,\"args\":{\"exit_code\":%d}}",
+                json_escape(e.name).c_str(), e.kind, (unsigned long long)e.start_us, (unsigned long long)e.dur_us, e.slot, e.exit_code);
+        max_slot = (std::max)(max_slot, e.slot);
+    }
+    for (uint32_t n = 0; n <= max_slot; n++) {
+        fprintf(fid, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,\"args\":{\"name\":\"slot %u\"}}", n, n);
+    }
+    fprintf(fid, "\n]}\n");
+
+    bool ok = fclose(fid) == 0;
+    build_trace.events.clear();
+    return ok;
+}
+
+/* a file mapped read-only into memory */
+struct mapped_file {
+    const char* data = nullptr;
+    size_t size = 0;
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+};
+
+#ifdef _WIN32
+bool map_file(const std::string& filename, mapped_file& out) {
+    out.file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE,
+                           NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (out.file == INVALID_HANDLE_VALUE) return false;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(out.file, &size) || size.QuadPart == 0) {
+        CloseHandle(out.file);
+        out.file = INVALID_HANDLE_VALUE;
+        return false;
+    }
+
+    out.mapping = CreateFileMappingA(out.file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (out.mapping) {
+        out.data = (const char*)MapViewOfFile(out.mapping, FILE_MAP_READ, 0, 0, 0);
+    }
+    if (!out.data) {
+        if (out.mapping) CloseHandle(out.mapping);
+        CloseHandle(out.file);
+        out.mapping = NULL;
+        out.file = INVALID_HANDLE_VALUE;
+        return false;
+    }
+
+    out.size = (size_t)size.QuadPart;
+    return true;
+}
+
+void unmap_file(mapped_file& m) {
+    if (m.data)    UnmapViewOfFile(m.data);
+    if (m.mapping) CloseHandle(m.mapping);
+    if (m.file != INVALID_HANDLE_VALUE) CloseHandle(m.file);
+    m = mapped_file();
+}
+#else
+bool map_file(const std::string& filename, mapped_file& out) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0 || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return false;
+    }
+
+    void* data = mmap(NULL, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd); // the mapping keeps the file alive
+    if (data == MAP_FAILED) return false;
+
+    out.data = (const char*)data;
+    out.size = (size_t)st.st_size;
+    return true;
+}
+
+void unmap_file(mapped_file& m) {
+    if (m.data) munmap((void*)m.data, m.size);
+    m = mapped_file();
+}
+#endif
+
+/* 128-bit non-cryptographic hash used for all change detection.
+* same structure as xxh3 (but not bit-compatible with it): 8 64-bit lanes eat the input
+* in 64-byte stripes mixed with a 192-byte secret, get scrambled after every 1KB block,
+* and are folded down to 128 bits at the end.
+* the SSE2/AVX2 paths compute exactly the same values as the scalar one, so a hash
+* doesn't depend on the machine or platform it was computed on. (assumes little-endian)
+*/
+struct hash128 {
+    uint64 lo = 0;
+    uint64 hi = 0;
+};
+
+bool same_hash(const hash128& a, const hash128& b) {
+    return a.lo == b.lo && a.hi == b.hi;
+}
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#define BUILD_HASH_AVX2
+#elif defined(__SSE2__) || defined(_M_X64) || defined(_M_AMD64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define BUILD_HASH_SSE2
+#endif
+
+static const uint64 HASH_PRIME64_1 = 0x9E3779B185EBCA87ull;
+static const uint64 HASH_PRIME64_2 = 0xC2B2AE3D27D4EB4Full;
+static const uint64 HASH_PRIME64_3 = 0x165667B19E3779F9ull;
+static const uint64 HASH_PRIME64_4 = 0x85EBCA77C2B2AE63ull;
+static const uint64 HASH_PRIME64_5 = 0x27D4EB2F165667C5ull;
+static const uint64 HASH_PRIME32_1 = 0x9E3779B1ull;
+
+static const size_t HASH_STRIPE = 64;
+static const size_t HASH_SECRET = 192;
+static const size_t HASH_STRIPES_PER_BLOCK = (HASH_SECRET - HASH_STRIPE) / 8;
+static const size_t HASH_BLOCK = HASH_STRIPE * HASH_STRIPES_PER_BLOCK;
+
+inline uint64 hash_read64(const unsigned char* p) {
+    uint64 v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+// fixed pseudo-random bytes (splitmix64), the same on every run
+const unsigned char* hash_secret() {
+    struct secret_bytes {
+        unsigned char bytes[HASH_SECRET];
+        secret_bytes() {
+            uint64 x = HASH_PRIME64_5;
+            for (size_t n = 0; n < HASH_SECRET; n += 8) {
+                uint64 z = (x += 0x9E3779B97F4A7C15ull);
+                z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+                z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+                z ^= z >> 31;
+                memcpy(bytes + n, &z, 8);
+            }
+        }
+    };
+    static const secret_bytes secret;
+    return secret.bytes;
+}
+
+inline void hash_stripe(uint64* acc, const unsigned char* in, const unsigned char* key) {
+#if defined(BUILD_HASH_AVX2)
+    for (int n = 0; n < 2; n++) {
+        __m256i a  = _mm256_loadu_si256((const __m256i*)(acc + 4*n));
+        __m256i d  = _mm256_loadu_si256((const __m256i*)(in  + 32*n));
+        __m256i k  = _mm256_loadu_si256((const __m256i*)(key + 32*n));
+        __m256i dk = _mm256_xor_si256(d, k);
+        __m256i product = _mm256_mul_epu32(dk, _mm256_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m256i swapped = _mm256_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        a = _mm256_add_epi64(a, _mm256_add_epi64(product, swapped));
+        _mm256_storeu_si256((__m256i*)(acc + 4*n), a);
+    }
+#elif defined(BUILD_HASH_SSE2)
+    for (int n = 0; n < 4; n++) {
+        __m128i a  = _mm_loadu_si128((const __m128i*)(acc + 2*n));
+        __m128i d  = _mm_loadu_si128((const __m128i*)(in  + 16*n));
+        __m128i k  = _mm_loadu_si128((const __m128i*)(key + 16*n));
+        __m128i dk = _mm_xor_si128(d, k);
+        __m128i product = _mm_mul_epu32(dk, _mm_shuffle_epi32(dk, _MM_SHUFFLE(0, 3, 0, 1)));
+        __m128i swapped = _mm_shuffle_epi32(d, _MM_SHUFFLE(1, 0, 3, 2));
+        a = _mm_add_epi64(a, _mm_add_epi64(product, swapped));
+        _mm_storeu_si128((__m128i*)(acc + 2*n), a);
+    }
+#else
+    for (int n = 0; n < 8; n++) {
+        uint64 d  = hash_read64(in + 8*n);
+        uint64 dk = d ^ hash_read64(key + 8*n);
+        acc[n ^ 1] += d;
+        acc[n] += (dk & 0xFFFFFFFFull) * (dk >> 32);
+    }
+#endif
+}
+
+inline void hash_block(uint64* acc, const unsigned char* in) {
+    const unsigned char* secret = hash_secret();
+    for (size_t s = 0; s < HASH_STRIPES_PER_BLOCK; s++) {
+        hash_stripe(acc, in + s*HASH_STRIPE, secret + s*8);
+    }
+
+    // scramble
+    const unsigned char* key = secret + HASH_SECRET - HASH_STRIPE;
+    for (int n = 0; n < 8; n++) {
+        uint64 a = acc[n];
+        a ^= a >> 47;
+        a ^= hash_read64(key + 8*n);
+        acc[n] = a * HASH_PRIME32_1;
+    }
+}
+
+// 64x64 -> 128 bit multiply, folded back to 64 bits
+inline uint64 hash_mul_fold(uint64 a, uint64 b) {
+    uint64 a_lo = a & 0xFFFFFFFFull, a_hi = a >> 32;
+    uint64 b_lo = b & 0xFFFFFFFFull, b_hi = b >> 32;
+    uint64 lo_lo = a_lo * b_lo;
+    uint64 hi_lo = a_hi * b_lo;
+    uint64 lo_hi = a_lo * b_hi;
+    uint64 hi_hi = a_hi * b_hi;
+    uint64 cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFFull) + lo_hi;
+    uint64 upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+    uint64 lower = (cross << 32) | (lo_lo & 0xFFFFFFFFull);
+    return lower ^ upper;
+}
+
+inline uint64 hash_avalanche(uint64 h) {
+    h ^= h >> 37;
+    h *= 0x165667919E3779F9ull;
+    h ^= h >> 32;
+    return h;
+}
+
+/* incremental hashing: init, update with any number of chunks, final.
+* the result only depends on the bytes, not on how they were split into chunks.
+*/
+struct hash_state {
+    uint64 acc[8];
+    unsigned char buffer[HASH_BLOCK];
+    size_t buffered;
+    uint64 total;
+};
+
+void hash_init(hash_state& st) {
+    st.acc[0] = HASH_PRIME32_1;  st.acc[1] = HASH_PRIME64_1;
+    st.acc[2] = HASH_PRIME64_2;  st.acc[3] = HASH_PRIME64_3;
+    st.acc[4] = HASH_PRIME64_4;  st.acc[5] = 0x85EBCA77ull;
+    st.acc[6] = HASH_PRIME64_5;  st.acc[7] = 0xC2B2AE3Dull;
+    st.buffered = 0;
+    st.total = 0;
+}
+
+void hash_update(hash_state& st, const void* data, size_t len) {
+    const unsigned char* p = (const unsigned char*)data;
+    st.total += len;
+
+    // the last 1..HASH_BLOCK bytes always stay buffered, hash_final() handles them
+    if (st.buffered + len <= HASH_BLOCK) {
+        memcpy(st.buffer + st.buffered, p, len);
+        st.buffered += len;
+        return;
+    }
+
+    if (st.buffered) {
+        size_t fill = HASH_BLOCK - st.buffered;
+        memcpy(st.buffer + st.buffered, p, fill);
+        p += fill;
+        len -= fill;
+        hash_block(st.acc, st.buffer);
+        st.buffered = 0;
+    }
+
+    while (len > HASH_BLOCK) {
+        hash_block(st.acc, p);
+        p += HASH_BLOCK;
+        len -= HASH_BLOCK;
+    }
+
+    memcpy(st.buffer, p, len);
+    st.buffered = len;
+}
+
+hash128 hash_final(const hash_state& st) {
+    const unsigned char* secret = hash_secret();
+
+    uint64 acc[8];
+    memcpy(acc, st.acc, sizeof(acc));
+
+    size_t stripes = st.buffered / HASH_STRIPE;
+    for (size_t s = 0; s < stripes; s++) {
+        hash_stripe(acc, st.buffer + s*HASH_STRIPE, secret + s*8);
+    }
+    size_t rest = st.buffered - stripes*HASH_STRIPE;
+    if (rest) {
+        unsigned char last[HASH_STRIPE] = {};
+        memcpy(last, st.buffer + stripes*HASH_STRIPE, rest);
+        hash_stripe(acc, last, secret + stripes*8);
+    }
+
+    hash128 h;
+    h.lo = st.total * HASH_PRIME64_1;
+    h.hi = ~(st.total * HASH_PRIME64_2);
+    for (int n = 0; n < 4; n++) {
+        h.lo += hash_mul_fold(acc[2*n] ^ hash_read64(secret + 11  + 16*n), acc[2*n+1] ^ hash_read64(secret + 19  + 16*n));
+        h.hi += hash_mul_fold(acc[2*n] ^ hash_read64(secret + 100 + 16*n), acc[2*n+1] ^ hash_read64(secret + 108 + 16*n));
+    }
+    h.lo = hash_avalanche(h.lo);
+    h.hi = hash_avalanche(h.hi ^ h.lo);
+    return h;
+}
+
+hash128 hash_bytes(const void* data, size_t len) {
+    hash_state st;
+    hash_init(st);
+    hash_update(st, data, len);
+    return hash_final(st);
+}
+
+uint64 hash_string(const std::string& str) {
+    return hash_bytes(str.data(), str.size()).lo;
+}
+
+// arguments are separated by a 0 byte, so {"a b"} and {"a", "b"} hash differently
+uint64 hash_command(const command_args& args) {
+    hash_state st;
+    hash_init(st);
+    for (const auto& a : args) {
+        hash_update(st, a.data(), a.size());
+        hash_update(st, "", 1);
+    }
+    return hash_final(st).lo;
+}
+
+// hash a file's contents: mapped if possible, streamed otherwise (e.g. empty files can't be mapped)
+bool hash_file_contents(const std::string& filename, hash128& out) {
+    mapped_file m;
+    if (map_file(filename, m)) {
+        out = hash_bytes(m.data, m.size);
+        unmap_file(m);
+        return true;
+    }
+
+    FILE* fid = fopen(filename.c_str(), "rb");
+    if (!fid) return false;
+
+    hash_state st;
+    hash_init(st);
+    std::vector<char> buf(64 * 1024);
+    size_t n;
+    while ((n = fread(buf.data(), 1, buf.size(), fid)) > 0) {
+        hash_update(st, buf.data(), n);
+    }
+    fclose(fid);
+
+    out = hash_final(st);
+    return true;
+}
+
+// hash a batch of files on the pool. waits for the whole pool to go idle.
+void hash_files_parallel(job_pool& pool, const std::vector<std::string>& files, std::vector<hash128>& hashes, std::vector<char>& ok) {
+    hashes.assign(files.size(), hash128());
+    ok.assign(files.size(), 0);
+    for (size_t n = 0; n < files.size(); n++) {
+        pool.submit([&, n]() {
+            ok[n] = hash_file_contents(files[n], hashes[n]) ? 1 : 0;
+        });
+    }
+    pool.wait();
+}
+
+/* dependency graph between the targets of a project.
+* deps[n] are the targets that target n needs linked first,
+* dependents[n] are the targets waiting on target n.
+*/
+struct target_graph {
+    std::vector<std::vector<int>> deps;
+    std::vector<std::vector<int>> dependents;
+    std::vector<int> order; // every target comes after its dependencies
+};
+
+// "..\\bin\\shared_lib.lib" -> "shared_lib", and the same for "-lshared_lib" or "bin/libshared_lib.so"
+std::string lib_base_name(const std::string& lib) {
+    std::string path = lib;
+    if (lib.compare(0, 3, "-l:") == 0)      path = lib.substr(3);
+    else if (lib.compare(0, 2, "-l") == 0) return lib.substr(2);
+
+    size_t last_slash = path.find_last_of("\\/");
+    std::string name = (last_slash == std::string::npos) ? path : path.substr(last_slash + 1);
+    size_t last_dot = name.find_last_of('.');
+    std::string ext;
+    if (last_dot != std::string::npos) {
+        ext = name.substr(last_dot);
+        name = name.substr(0, last_dot);
+    }
+    if ((ext == ".so" || ext == ".a") && name.compare(0, 3, "lib") == 0) name = name.substr(3);
+    return name;
+}
+
+bool visit_target(const project_config& conf, target_graph& graph, int n, std::vector<int>& state, std::vector<int>& stack) {
+    if (state[n] == 2) return true;
+    if (state[n] == 1) {
+        // n is already on the stack -> everything from there on is a cycle
+        std::string cycle;
+        auto it = std::find(stack.begin(), stack.end(), n);
+        for (; it != stack.end(); ++it) {
+            cycle += conf.targets[*it].target_name + " -> ";
+        }
+        cycle += conf.targets[n].target_name;
+        printf("Error: dependency cycle between targets: %s\n", cycle.c_str());
+        return false;
+    }
+
+    state[n] = 1;
+    stack.push_back(n);
+    for (int d : graph.deps[n]) {
+        if (!visit_target(conf, graph, d, state, stack)) return false;
+    }
+    stack.pop_back();
+    state[n] = 2;
+
+    graph.order.push_back(n);
+    return true;
+}
+
+bool build_target_graph(const project_config& conf, target_graph& graph) {
+    int num_targets = conf.targets.size();
+    graph.deps.assign(num_targets, {});
+    graph.dependents.assign(num_targets, {});
+    graph.order.clear();
+
+    std::unordered_map<std::string, int> by_name;
+    for (int n = 0; n < num_targets; n++) {
+        const std::string& name = conf.targets[n].target_name;
+        if (by_name.count(name)) {
+            printf("Error: two targets named [%s]\n", name.c_str());
+            return false;
+        }
+        by_name[name] = n;
+    }
+
+    for (int n = 0; n < num_targets; n++) {
+        const target_config& targ = conf.targets[n];
+        std::vector<int>& deps = graph.deps[n];
+
+        for (const auto& d : targ.depends_on) {
+            auto it = by_name.find(d);
+            if (it == by_name.end()) {
+                printf("Error: target [%s] depends on unknown target [%s]\n", targ.target_name.c_str(), d.c_str());
+                return false;
+            }
+            deps.push_back(it->second);
+        }
+
+        // libs that aren't built by this project (e.g. user32.lib) are just ignored
+        for (const auto& l : targ.link_libs) {
+            auto it = by_name.find(lib_base_name(l));
+            if (it != by_name.end() && it->second != n) {
+                deps.push_back(it->second);
+            }
+        }
+
+        std::sort(deps.begin(), deps.end());
+        deps.erase(std::unique(deps.begin(), deps.end()), deps.end());
+        for (int d : deps) {
+            graph.dependents[d].push_back(n);
+        }
+    }
+
+    std::vector<int> state(num_targets, 0); // 0: unvisited, 1: on the stack, 2: done
+    std::vector<int> stack;
+    for (int n = 0; n < num_targets; n++) {
+        if (!visit_target(conf, graph, n, state, stack)) return false;
+    }
+
+    return true;
+}
+
+/* unity builds.
+* batch boundaries are picked so that adding, removing or editing one source only changes
+* the batch it is in: sources are sorted by path, and a new batch starts at every source whose
+* path hash is a multiple of unity_batch_size. the hashes alone can put long runs of sources
+* together, so a batch is also cut at twice unity_batch_size files (and wherever it hits
+* unity_max_bytes); that only moves the boundaries up to the next anchor.
+* each batch is named after its first source, so untouched batches keep their file and object.
+*/
+uint64 source_size(const std::string& filename) {
+    std::ifstream in(filename, std::ios::binary | std::ios::ate);
+    if (!in) return 0;
+    return (uint64)in.tellg();
+}
+
+bool unity_excluded(const target_config& targ, const std::string& src) {
+    size_t last_slash = src.find_last_of("\\/");
+    std::string name = (last_slash == std::string::npos) ? src : src.substr(last_slash + 1);
+    for (const auto& ex : targ.unity_exclude) {
+        if (ex == src || ex == name) return true;
+    }
+    return false;
+}
+
+// rewrite a generated file only when its contents change, so its timestamp stays put otherwise
+bool write_if_changed(const std::string& filename, const std::string& contents) {
+    {
+        std::ifstream in(filename, std::ios::binary);
+        if (in) {
+            std::string old((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+            if (old == contents) return true;
+        }
+    }
+
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    out << contents;
+    return (bool)out;
+}
+
+// returns the file to compile in place of `batch`
+bool write_unity_batch(const project_config& conf, const target_config& targ, const std::vector<std::string>& batch, std::string& out_file) {
+    if (batch.size() == 1) {
+        out_file = batch[0];
+        return true;
+    }
+
+    std::string contents = "// generated unity batch for [" + targ.target_name + "], do not edit\n";
+    for (const auto& src : batch) {
+        std::string path = absolute_path(src);
+        std::replace(path.begin(), path.end(), '\\', '/');
+        contents += "#include \"" + path + "\"\n";
+    }
+
+    out_file = target_obj_dir(conf, targ) + path_sep + format_str("unity_%016llx.cpp", (unsigned long long)hash_string(batch[0]));
+    if (!write_if_changed(out_file, contents)) {
+        printf("Error: could not write unity batch [%s]\n", out_file.c_str());
+        return false;
+    }
+    return true;
+}
+
+// swap the src_files of every unity target for its batch files (and the excluded sources)
+bool write_unity_batches(project_config& conf) {
+    for (auto& targ : conf.targets) {
+        if (!targ.unity_build) continue;
+
+        std::vector<std::string> merged, files;
+        for (const auto& src : targ.src_files) {
+            if (unity_excluded(targ, src)) files.push_back(src);
+            else                           merged.push_back(src);
+        }
+        std::sort(merged.begin(), merged.end());
+
+        uint64 batch_every = targ.unity_batch_size ? targ.unity_batch_size : 1;
+        uint64 batch_max = batch_every * 2;
+        std::vector<std::string> batch;
+        uint64 batch_bytes = 0;
+        for (const auto& src : merged) {
+            uint64 size = source_size(src);
+            bool anchor = (hash_string(src) % batch_every) == 0;
+            bool full = batch_bytes + size > targ.unity_max_bytes || batch.size() >= batch_max;
+            if (batch.size() && (anchor || full)) {
+                std::string file;
+                if (!write_unity_batch(conf, targ, batch, file)) return false;
+                files.push_back(file);
+                batch.clear();
+                batch_bytes = 0;
+            }
+            batch.push_back(src);
+            batch_bytes += size;
+        }
+        if (batch.size()) {
+            std::string file;
+            if (!write_unity_batch(conf, targ, batch, file)) return false;
+            files.push_back(file);
+        }
+
+        targ.src_files = files;
+    }
+    return true;
+}
+
+// the pch source is empty for cl.exe: /FI pulls the header in, and /Yc turns that into the .pch.
+// gcc/clang compile the header they are given, so theirs #includes pch_header.
+bool write_pch_sources(const project_config& conf) {
+    for (const auto& targ : conf.targets) {
+        if (targ.pch_header.empty()) continue;
+
+        std::string file = pch_source_file(conf, targ);
+        std::string contents = "// generated precompiled header source for [" + targ.target_name + "], do not edit\n";
+        if (gnu_toolchain(conf)) {
+            std::string header = absolute_path(targ.pch_header);
+            std::replace(header.begin(), header.end(), '\\', '/');
+            contents += "#include \"" + header + "\"\n";
+        }
+        if (!write_if_changed(file, contents)) {
+            printf("Error: could not write [%s]\n", file.c_str());
+            return false;
+        }
+    }
+    return true;
+}
+
+// keep the first error code that any job reports
+void record_error(std::atomic<int>& first_error, int res) {
+    int none = 0;
+    first_error.compare_exchange_strong(none, res);
+}
+
+int build_project(const project_config& project) {
+    // unity targets get their src_files replaced, so work on a copy
+    project_config conf = project;
+    int num_targets = conf.targets.size();
+    unsigned int num_jobs = get_job_count(conf);
+    jobserver_init(conf);
+    printf("Full Build [%s]: %d targets, %u jobs.\n", conf.project_name.c_str(), num_targets, num_jobs);
+
+    target_graph graph;
+    if (!build_target_graph(conf, graph)) {
+        return -1;
+    }
+
+    ensure_output_dirs(conf);
+    if (!write_unity_batches(conf) || !write_pch_sources(conf)) {
+        return -1;
+    }
+
+    trace_begin(conf);
+
+    // each target is one cl.exe call, so there is no work to do in-process:
+    // a single loop starts the compilers, up to num_jobs at a time, and collects their output.
+    process_group group;
+    int first_error = 0;
+
+    // which of the num_jobs process slots are in use, so the timeline gets one row per slot.
+    // each slot also holds a jobserver token, taken without waiting: this thread has to keep draining the children
+    std::vector<char> slot_busy(num_jobs, 0);
+    std::vector<job_token> slot_tokens(num_jobs);
+    auto take_slot = [&]() {
+        uint32_t slot = 0;
+        while (slot_busy[slot]) slot++;
+        slot_busy[slot] = 1;
+        return slot;
+    };
+    auto free_slot = [&](uint32_t slot) {
+        slot_busy[slot] = 0;
+        jobserver_release(slot_tokens[slot]);
+    };
+
+    std::vector<int> deps_left(num_targets);
+    std::vector<char> pch_built(num_targets, 0);
+    std::deque<int> ready;
+    for (int n : graph.order) {
+        deps_left[n] = graph.deps[n].size();
+        if (deps_left[n] == 0) ready.push_back(n);
+    }
+
+    // a target is started once every target it depends on has finished.
+    // targets that don't depend on each other build side by side.
+    while (ready.size() || group.running()) {
+        while (first_error == 0 && ready.size() && group.running() < num_jobs) {
+            job_token token;
+            if (!jobserver_acquire(token, group.running() == 0)) break;
+
+            int n = ready.front();
+            ready.pop_front();
+
+            // a precompiled header has to be created (/Yc) before the one cl.exe call that uses it
+            const target_config& targ = conf.targets[n];
+            uint32_t slot = take_slot();
+            slot_tokens[slot] = token;
+            uint64 start_us = trace_now_us();
+            if (targ.pch_header.size() && !pch_built[n]) {
+                bool started = group.spawn(generate_compile_cmd(conf, targ, pch_source_file(conf, targ)), output_sink(), [&, n, slot, start_us](process_result& res) {
+                    free_slot(slot);
+                    trace_record("compile", pch_source_file(conf, conf.targets[n]), start_us, trace_now_us(), slot, res.exit_code);
+                    if (res.exit_code) {
+                        if (first_error == 0) first_error = res.exit_code;
+                        printf("    Building [%s] precompiled header...Failed! ErrorCode: %d\n", conf.targets[n].target_name.c_str(), res.exit_code);
+                        printf("%s\n", res.std_out.c_str());
+                        printf("%s\n", res.std_err.c_str());
+                        return;
+                    }
+                    pch_built[n] = 1;
+                    ready.push_front(n);
+                });
+
+                if (!started) {
+                    free_slot(slot);
+                    first_error = -1;
+                    printf("    Building [%s]...Failed! Could not start the compiler.\n", targ.target_name.c_str());
+                }
+                continue;
+            }
+
+            bool started = group.spawn(generate_target_build_cmd(conf, targ), output_sink(), [&, n, slot, start_us](process_result& res) {
+                const target_config& targ = conf.targets[n];
+                free_slot(slot);
+                trace_record("build", targ.target_name, start_us, trace_now_us(), slot, res.exit_code);
+                if (res.exit_code) {
+                    if (first_error == 0) first_error = res.exit_code;
+                    printf("    Building [%s]...Failed! ErrorCode: %d\n", targ.target_name.c_str(), res.exit_code);
+                    printf("%s\n", res.std_out.c_str());
+                    printf("%s\n", res.std_err.c_str());
+                    return;
+                }
+
+                printf("    Building [%s]...Done.\n", targ.target_name.c_str());
+                for (int d : graph.dependents[n]) {
+                    if (--deps_left[d] == 0) ready.push_back(d);
+                }
+            });
+
+            if (!started) {
+                free_slot(slot);
+                first_error = -1;
+                printf("    Building [%s]...Failed! Could not start the compiler.\n", targ.target_name.c_str());
+            }
+        }
+
+        if (first_error) ready.clear();
+        group.step();
+    }
+
+    trace_end(conf);
+    return first_error;
+}
+
+/* content hashes of source and header files, computed at most once per build.
+* a header included by hundreds of sources only gets read the first time one of them asks.
+*/
+std::mutex file_hash_lock;
+std::unordered_map<std::string, hash128> file_hash_cache;
+
+bool hash_file(const std::string& filename, hash128& out) {
+    {
+        std::lock_guard<std::mutex> guard(file_hash_lock);
+        auto it = file_hash_cache.find(filename);
+        if (it != file_hash_cache.end()) {
+            out = it->second;
+            return true;
+        }
+    }
+
+    trace_scope trace("hash", filename);
+    if (!hash_file_contents(filename, out)) {
+        trace.exit_code = -1;
+        return false;
+    }
+
+    std::lock_guard<std::mutex> guard(file_hash_lock);
+    file_hash_cache[filename] = out;
+    return true;
+}
+
+/* the metadata we compare before bothering to hash a file.
+* if all three match what was recorded, the file is assumed unchanged.
+*/
+struct file_stamp {
+    uint64 mtime = 0;
+    uint64 size = 0;
+    uint64 file_id = 0;
+};
+
+// mtime 0 is a stamp taken too soon after a write to be trusted (see stat_file), it never matches
+bool same_stamp(const file_stamp& a, const file_stamp& b) {
+    return a.mtime != 0 && a.mtime == b.mtime && a.size == b.size && a.file_id == b.file_id;
+}
+
+// like file_hash_cache, every file is only stat'ed once per build
+std::unordered_map<std::string, file_stamp> file_stamp_cache;
+
+// the stamp as it is on disk right now, not cached
+bool read_file_stamp(const std::string& filename, file_stamp& out) {
+#ifdef _WIN32
+    // opening with no access rights is enough to query the file index
+    HANDLE file = CreateFileA(filename.c_str(), 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS, NULL);
+    if (file == INVALID_HANDLE_VALUE) {
+        return false;
+    }
+
+    BY_HANDLE_FILE_INFORMATION info;
+    BOOL found = GetFileInformationByHandle(file, &info);
+    CloseHandle(file);
+    if (!found) {
+        return false;
+    }
+
+    out.mtime   = ((uint64)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+    out.size    = ((uint64)info.nFileSizeHigh << 32) | info.nFileSizeLow;
+    out.file_id = ((uint64)info.nFileIndexHigh << 32) | info.nFileIndexLow;
+#else
+    struct stat st;
+    if (stat(filename.c_str(), &st) != 0) {
+        return false;
+    }
+
+    out.mtime   = (uint64)st.st_mtim.tv_sec * 1000000000ull + (uint64)st.st_mtim.tv_nsec;
+    out.size    = (uint64)st.st_size;
+    out.file_id = (uint64)st.st_ino;
+#endif
+    return true;
+}
+
+bool stat_file(const std::string& filename, file_stamp& out) {
+    {
+        std::lock_guard<std::mutex> guard(file_hash_lock);
+        auto it = file_stamp_cache.find(filename);
+        if (it != file_stamp_cache.end()) {
+            out = it->second;
+            return true;
+        }
+    }
+
+    if (!read_file_stamp(filename, out)) {
+        return false;
+    }
+
+#ifdef _WIN32
+    // a file written in the last couple of seconds could still change again without its
+    // mtime moving (coarse timestamps). don't trust a stamp like that, force a hash next time.
+    FILETIME now_ft;
+    GetSystemTimeAsFileTime(&now_ft);
+    uint64 now = ((uint64)now_ft.dwHighDateTime << 32) | now_ft.dwLowDateTime;
+    const uint64 two_seconds = 2ull * 10000000ull; // 100ns ticks
+    if (out.mtime + two_seconds > now) {
+        out.mtime = 0;
+    }
+#else
+    // same as above, in ns
+    timespec now_ts;
+    clock_gettime(CLOCK_REALTIME, &now_ts);
+    uint64 now = (uint64)now_ts.tv_sec * 1000000000ull + (uint64)now_ts.tv_nsec;
+    const uint64 two_seconds = 2000000000ull;
+    if (out.mtime + two_seconds > now) {
+        out.mtime = 0;
+    }
+#endif
+
+    std::lock_guard<std::mutex> guard(file_hash_lock);
+    file_stamp_cache[filename] = out;
+    return true;
+}
+
+bool file_exists(const std::string& filename) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    return GetFileAttributesExA(filename.c_str(), GetFileExInfoStandard, &info) != 0;
+#else
+    struct stat st;
+    return stat(filename.c_str(), &st) == 0;
+#endif
+}
+
+bool delete_file(const std::string& filename) {
+#ifdef _WIN32
+    return DeleteFileA(filename.c_str()) != 0;
+#else
+    return unlink(filename.c_str()) == 0;
+#endif
+}
+
+// move `from` over `to` in one step, so nobody ever sees a half-written `to`
+bool replace_file(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+    return MoveFileExA(from.c_str(), to.c_str(), MOVEFILE_REPLACE_EXISTING) != 0;
+#else
+    return rename(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+bool copy_file(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+    return CopyFileA(from.c_str(), to.c_str(), FALSE) != 0;
+#else
+    std::ifstream in(from, std::ios::binary);
+    std::ofstream out(to, std::ios::binary | std::ios::trunc);
+    if (!in || !out) return false;
+    out << in.rdbuf();
+    out.close();
+    return !out.fail();
+#endif
+}
+
+// `to` becomes another name for `from`. only works on the same volume
+bool hard_link_file(const std::string& from, const std::string& to) {
+#ifdef _WIN32
+    return CreateHardLinkA(to.c_str(), from.c_str(), NULL) != 0;
+#else
+    return link(from.c_str(), to.c_str()) == 0;
+#endif
+}
+
+// pull the "Note: including file:" lines that /showIncludes adds out of the compiler output.
+// everything else (warnings, errors) is left in std_out.
+std::vector<std::string> extract_show_includes(std::string& std_out) {
+    static const char prefix[] = "Note: including file:";
+    const size_t prefix_len = sizeof(prefix) - 1;
+
+    std::vector<std::string> includes;
+    std::string rest;
+
+    size_t start = 0;
+    while (start < std_out.size()) {
+        size_t end = std_out.find('\n', start);
+        if (end == std::string::npos) end = std_out.size();
+        std::string line = std_out.substr(start, end - start);
+        start = end + 1;
+
+        if (line.compare(0, prefix_len, prefix) == 0) {
+            size_t first = line.find_first_not_of(' ', prefix_len);
+            size_t last  = line.find_last_not_of("\r ");
+            if (first != std::string::npos) {
+                includes.push_back(line.substr(first, last - first + 1));
+            }
+        } else {
+            rest += line + "\n";
+        }
+    }
+
+    std::sort(includes.begin(), includes.end());
+    includes.erase(std::unique(includes.begin(), includes.end()), includes.end());
+
+    std_out = rest;
+    return includes;
+}
+
+/* the headers in the Makefile-style depfile gcc/clang write with -MD:
+*   out.o: src.cpp include/a.h \
+*    include/with\ space.h
+* the first prerequisite is the source itself, which isn't returned.
+*/
+std::vector<std::string> read_depfile(const std::string& filename) {
+    std::vector<std::string> includes;
+    std::ifstream fid(filename, std::ios::binary);
+    if (!fid.is_open()) return includes;
+    std::string text((std::istreambuf_iterator<char>(fid)), std::istreambuf_iterator<char>());
+
+    // the target ends at the first ':' followed by whitespace (a drive letter isn't)
+    size_t n = 0;
+    while (n < text.size() && !(text[n] == ':' && (n + 1 == text.size() || isspace((unsigned char)text[n + 1])))) n++;
+    n++;
+
+    std::vector<std::string> prereqs;
+    std::string cur;
+    for (; n < text.size(); n++) {
+        char c = text[n];
+        if (c == '\\' && n + 1 < text.size()) {
+            char next = text[n + 1];
+            if (next == '\n' || (next == '\r' && n + 2 < text.size() && text[n + 2] == '\n')) {
+                // line continuation
+                n += (next == '\r') ? 2 : 1;
+                c = ' ';
+            } else if (next == ' ' || next == '#') {
+                cur += next;
+                n++;
+                continue;
+            }
+        } else if (c == '$' && n + 1 < text.size() && text[n + 1] == '$') {
+            n++;
+        } else if (c == '\n') {
+            break; // end of the rule
+        }
+
+        if (isspace((unsigned char)c)) {
+            if (cur.size()) prereqs.push_back(cur);
+            cur.clear();
+        } else {
+            cur += c;
+        }
+    }
+    if (cur.size()) prereqs.push_back(cur);
+
+    if (prereqs.size()) includes.assign(prereqs.begin() + 1, prereqs.end());
+    std::sort(includes.begin(), includes.end());
+    includes.erase(std::unique(includes.begin(), includes.end()), includes.end());
+    return includes;
+}
+
+// the headers a compile read: the /showIncludes lines cl.exe printed (which are taken out of
+// std_out), or the depfile gcc/clang wrote next to out_file
+std::vector<std::string> compile_includes(const project_config& conf, const std::string& out_file, std::string& std_out) {
+    std::vector<std::string> includes = gnu_toolchain(conf) ? read_depfile(out_file + ".d") : extract_show_includes(std_out);
+
+    // gcc/clang objects are optimized with the profile (msvc only reads it when linking)
+    if (conf.pgo == pgo_use && gnu_toolchain(conf)) includes.push_back(pgo_profile_id_file(conf));
+    return includes;
+}
+
+struct dep_info {
+    std::string path;
+    hash128 hash;
+    file_stamp stamp;
+};
+
+/* what we know about a source file from the last time it was compiled */
+struct tu_record {
+    hash128 pre_hash; // preprocessed output
+    hash128 src_hash; // the source file itself
+    file_stamp src_stamp;
+    uint64 cmd_hash = 0; // the full compile command it was built with
+    uint32_t compile_ms = 0; // how long the last compile took
+    uint32_t peak_rss_kb = 0; // and the most memory it needed, 0 if it never ran here
+    std::vector<dep_info> deps; // every header the compiler reported, hashed at compile time
+};
+
+/* the build state file: everything the incremental build remembers, for the whole project.
+*   state_header
+*   uint32_t     string_offsets[num_strings]  (into the string blob)
+*   char         strings[string_bytes]        (every path/name once, NUL-terminated, padded to 8)
+*   state_target targets[num_targets]
+*   state_tu     tus[num_tus]                 (a target's tus are contiguous)
+*   state_dep    deps[num_deps]               (a tu's deps are contiguous, so are a target's link inputs)
+*   state_dir    dirs[num_dirs]               (listings cached by find_files)
+*   state_dir_entry dir_entries[num_dir_entries] (a dir's entries are contiguous)
+* it stays mapped read-only during the build, and is replaced (write + rename) at the end.
+*/
+static const uint32_t state_magic   = 0x54534242; // "BBST"
+static const uint32_t state_version = 5;
+
+struct state_header {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t num_strings;
+    uint32_t string_bytes;
+    uint32_t num_targets;
+    uint32_t num_tus;
+    uint32_t num_deps;
+    uint32_t num_dirs;
+    uint32_t num_dir_entries;
+    uint32_t reserved;
+};
+
+struct state_target {
+    uint32_t name;
+    uint32_t first_tu;
+    uint32_t num_tus;
+    uint32_t first_input;
+    uint32_t num_inputs;
+    uint32_t link_peak_kb;
+    uint64 link_hash;
+};
+
+struct state_tu {
+    uint32_t src;
+    uint32_t first_dep;
+    uint32_t num_deps;
+    uint32_t compile_ms;
+    uint32_t peak_rss_kb;
+    uint32_t reserved;
+    hash128 pre_hash;
+    hash128 src_hash;
+    uint64 src_mtime;
+    uint64 src_size;
+    uint64 src_file_id;
+    uint64 cmd_hash;
+};
+
+struct state_dep {
+    uint32_t path;
+    uint32_t reserved;
+    hash128 hash;
+    uint64 mtime;
+    uint64 size;
+    uint64 file_id;
+};
+
+struct state_dir {
+    uint32_t path;
+    uint32_t first_entry;
+    uint32_t num_entries;
+    uint32_t reserved;
+    uint64 mtime;
+};
+
+struct state_dir_entry {
+    uint32_t name;
+    uint32_t is_dir;
+};
+
+static_assert(sizeof(state_header) == 40, "state_header layout");
+static_assert(sizeof(state_target) == 32, "state_target layout");
+static_assert(sizeof(state_tu)     == 88, "state_tu layout");
+static_assert(sizeof(state_dep)    == 48, "state_dep layout");
+static_assert(sizeof(state_dir)    == 24, "state_dir layout");
+static_assert(sizeof(state_dir_entry) == 8, "state_dir_entry layout");
+
+struct build_state {
+    mapped_file file;
+    const state_header* header = nullptr;
+    const uint32_t*     string_offsets = nullptr;
+    const char*         strings = nullptr;
+    const state_target* targets = nullptr;
+    const state_tu*     tus = nullptr;
+    const state_dep*    deps = nullptr;
+    const state_dir*    dirs = nullptr;
+    const state_dir_entry* dir_entries = nullptr;
+};
+
+size_t align8(size_t n) {
+    return (n + 7) & ~(size_t)7;
+}
+
+const char* state_string(const build_state& state, uint32_t id) {
+    return state.strings + state.string_offsets[id];
+}
+
+bool in_range(uint32_t first, uint32_t count, uint32_t total) {
+    return (uint64)first + count <= total;
+}
+
+/* every index the loaders follow, checked once when the file is opened so they don't have to:
+* string ids, string offsets (the blob has to end in a NUL), and the tu/dep/entry ranges.
+*/
+bool check_build_state(const build_state& state) {
+    const state_header& h = *state.header;
+    if (h.num_strings && (h.string_bytes == 0 || state.strings[h.string_bytes - 1] != 0)) return false;
+    for (uint32_t n = 0; n < h.num_strings; n++) {
+        if (state.string_offsets[n] >= h.string_bytes) return false;
+    }
+
+    for (uint32_t n = 0; n < h.num_targets; n++) {
+        const state_target& t = state.targets[n];
+        if (t.name >= h.num_strings || !in_range(t.first_tu, t.num_tus, h.num_tus) ||
+            !in_range(t.first_input, t.num_inputs, h.num_deps)) return false;
+    }
+    for (uint32_t n = 0; n < h.num_tus; n++) {
+        const state_tu& t = state.tus[n];
+        if (t.src >= h.num_strings || !in_range(t.first_dep, t.num_deps, h.num_deps)) return false;
+    }
+    for (uint32_t n = 0; n < h.num_deps; n++) {
+        if (state.deps[n].path >= h.num_strings) return false;
+    }
+    for (uint32_t n = 0; n < h.num_dirs; n++) {
+        const state_dir& d = state.dirs[n];
+        if (d.path >= h.num_strings || !in_range(d.first_entry, d.num_entries, h.num_dir_entries)) return false;
+    }
+    for (uint32_t n = 0; n < h.num_dir_entries; n++) {
+        if (state.dir_entries[n].name >= h.num_strings) return false;
+    }
+    return true;
+}
+
+// map an existing state file. a missing, corrupt or old-version file just leaves `state` empty.
+bool open_build_state(build_state& state, const std::string& filename) {
+    if (!map_file(filename, state.file)) return false;
+
+    const char* data = state.file.data;
+    size_t size = state.file.size;
+    const state_header* h = (const state_header*)data;
+
+    bool valid = size >= sizeof(state_header) && h->magic == state_magic && h->version == state_version;
+    if (valid) {
+        size_t strings_at = sizeof(state_header) + (size_t)h->num_strings * sizeof(uint32_t);
+        size_t targets_at = align8(strings_at + h->string_bytes);
+        size_t tus_at     = targets_at + (size_t)h->num_targets * sizeof(state_target);
+        size_t deps_at    = tus_at     + (size_t)h->num_tus     * sizeof(state_tu);
+        size_t dirs_at    = deps_at    + (size_t)h->num_deps    * sizeof(state_dep);
+        size_t entries_at = dirs_at    + (size_t)h->num_dirs    * sizeof(state_dir);
+        size_t end        = entries_at + (size_t)h->num_dir_entries * sizeof(state_dir_entry);
+        valid = end == size;
+
+        if (valid) {
+            state.header         = h;
+            state.string_offsets = (const uint32_t*)(data + sizeof(state_header));
+            state.strings        = data + strings_at;
+            state.targets        = (const state_target*)(data + targets_at);
+            state.tus            = (const state_tu*)(data + tus_at);
+            state.deps           = (const state_dep*)(data + deps_at);
+            state.dirs           = (const state_dir*)(data + dirs_at);
+            state.dir_entries    = (const state_dir_entry*)(data + entries_at);
+            valid = check_build_state(state);
+        }
+    }
+
+    if (!valid) {
+        unmap_file(state.file);
+        state = build_state();
+    }
+    return valid;
+}
+
+void close_build_state(build_state& state) {
+    unmap_file(state.file);
+    state = build_state();
+}
+
+/* directory listings remembered between runs, see find_files.
+* a listing is reused as long as its directory's last-write time hasn't moved, which
+* happens whenever an entry is added, removed or renamed in it.
+*/
+struct dir_entry {
+    std::string name;
+    bool is_dir;
+};
+
+struct dir_listing {
+    uint64 mtime = 0; // 0 -> too fresh to trust, read it again next time
+    std::vector<dir_entry> entries;
+    bool visited = false; // only listings find_files still walks get saved
+};
+
+struct dir_listing_cache {
+    std::mutex lock;
+    std::unordered_map<std::string, dir_listing> dirs;
+    bool enabled = false;
+};
+dir_listing_cache discovery_cache;
+
+
+void decode_deps(const build_state& state, uint32_t first, uint32_t count, std::vector<dep_info>& out) {
+    for (uint32_t n = 0; n < count; n++) {
+        const state_dep& d = state.deps[first + n];
+        dep_info dep;
+        dep.path = state_string(state, d.path);
+        dep.hash = d.hash;
+        dep.stamp.mtime   = d.mtime;
+        dep.stamp.size    = d.size;
+        dep.stamp.file_id = d.file_id;
+        out.push_back(dep);
+    }
+}
+
+tu_record decode_tu(const build_state& state, const state_tu& t) {
+    tu_record rec;
+    rec.pre_hash = t.pre_hash;
+    rec.src_hash = t.src_hash;
+    rec.src_stamp.mtime   = t.src_mtime;
+    rec.src_stamp.size    = t.src_size;
+    rec.src_stamp.file_id = t.src_file_id;
+    rec.cmd_hash = t.cmd_hash;
+    rec.compile_ms = t.compile_ms;
+    rec.peak_rss_kb = t.peak_rss_kb;
+    decode_deps(state, t.first_dep, t.num_deps, rec.deps);
+    return rec;
+}
+
+/* source file -> tu_record, one table per target.
+* records from the state file are only decoded when a compile job asks for them,
+* anything stored during this build lives in `entries`.
+* shared by all the compile jobs of a target, so every access takes the lock.
+*/
+struct hash_table {
+    std::mutex lock;
+    std::unordered_map<std::string, tu_record> entries;
+    uint64 link_hash = 0; // the link command of the last successful link
+    std::vector<dep_info> link_inputs; // the objects and libs that link read
+    uint32_t link_peak_kb = 0; // the most memory the last link needed
+
+    const build_state* state = nullptr;
+    std::unordered_map<std::string, uint32_t> mapped; // source file -> index into state->tus
+
+    bool find(const std::string& filename, tu_record& out) {
+        std::lock_guard<std::mutex> guard(lock);
+        auto it = entries.find(filename);
+        if (it != entries.end()) {
+            out = it->second;
+            return true;
+        }
+
+        auto m = mapped.find(filename);
+        if (m == mapped.end()) return false;
+        out = decode_tu(*state, state->tus[m->second]);
+        return true;
+    }
+
+    void store(const std::string& filename, const tu_record& record) {
+        std::lock_guard<std::mutex> guard(lock);
+        entries[filename] = record;
+    }
+
+    // decode every record still only in the mapped state, so the table outlives it (see watch_project)
+    void load_all() {
+        std::lock_guard<std::mutex> guard(lock);
+        for (const auto& m : mapped) {
+            if (!entries.count(m.first)) entries[m.first] = decode_tu(*state, state->tus[m.second]);
+        }
+        mapped.clear();
+        state = nullptr;
+    }
+};
+
+void read_table(const build_state& state, const std::string& target_name, hash_table& file_hashes) {
+    std::lock_guard<std::mutex> guard(file_hashes.lock);
+    file_hashes.entries.clear();
+    file_hashes.mapped.clear();
+    file_hashes.link_hash = 0;
+    file_hashes.link_inputs.clear();
+    file_hashes.link_peak_kb = 0;
+    file_hashes.state = &state;
+
+    if (!state.header) return;
+
+    for (uint32_t n = 0; n < state.header->num_targets; n++) {
+        const state_target& t = state.targets[n];
+        if (target_name != state_string(state, t.name)) continue;
+
+        file_hashes.link_hash = t.link_hash;
+        file_hashes.link_peak_kb = t.link_peak_kb;
+        decode_deps(state, t.first_input, t.num_inputs, file_hashes.link_inputs);
+        for (uint32_t k = 0; k < t.num_tus; k++) {
+            uint32_t idx = t.first_tu + k;
+            file_hashes.mapped[state_string(state, state.tus[idx].src)] = idx;
+        }
+        break;
+    }
+}
+
+std::string build_state_file(const project_config& conf) {
+    return conf.obj_dir + path_sep + conf.project_name + ".state";
+}
+
+// load the listings saved with the project's state, so find_files can skip unchanged dirs.
+// call it in the build-script before find_all_files, once conf.obj_dir is set.
+void use_discovery_cache(const project_config& conf) {
+    std::lock_guard<std::mutex> guard(discovery_cache.lock);
+    discovery_cache.enabled = true;
+    discovery_cache.dirs.clear();
+
+    build_state state;
+    if (!open_build_state(state, build_state_file(conf))) return;
+    for (uint32_t n = 0; n < state.header->num_dirs; n++) {
+        const state_dir& d = state.dirs[n];
+        dir_listing& listing = discovery_cache.dirs[state_string(state, d.path)];
+        listing.mtime = d.mtime;
+        for (uint32_t k = 0; k < d.num_entries; k++) {
+            const state_dir_entry& e = state.dir_entries[d.first_entry + k];
+            listing.entries.push_back({ state_string(state, e.name), e.is_dir != 0 });
+        }
+    }
+    close_build_state(state);
+}
+
+/* write a new state file from the tables of every target, then swap it in.
+* only records for each target's current src_files (and pch source) are kept.
+* `state` is unmapped before the rename, the tables can't be used after this.
+*/
+bool save_build_state(const project_config& conf, build_state& state, std::vector<std::unique_ptr<hash_table>>& tables) {
+    std::vector<uint32_t> string_offsets;
+    std::string strings;
+    std::unordered_map<std::string, uint32_t> interned;
+    auto intern = [&](const std::string& str) -> uint32_t {
+        auto it = interned.find(str);
+        if (it != interned.end()) return it->second;
+
+        uint32_t id = (uint32_t)string_offsets.size();
+        string_offsets.push_back((uint32_t)strings.size());
+        strings.append(str.c_str(), str.size() + 1);
+        interned[str] = id;
+        return id;
+    };
+
+    std::vector<state_target> targets;
+    std::vector<state_tu> tus;
+    std::vector<state_dep> deps;
+    auto add_deps = [&](const std::vector<dep_info>& list) {
+        for (const auto& d : list) {
+            state_dep dep = {};
+            dep.path = intern(d.path);
+            dep.hash = d.hash;
+            dep.mtime   = d.stamp.mtime;
+            dep.size    = d.stamp.size;
+            dep.file_id = d.stamp.file_id;
+            deps.push_back(dep);
+        }
+    };
+
+    for (size_t n = 0; n < conf.targets.size(); n++) {
+        const target_config& targ = conf.targets[n];
+
+        state_target t = {};
+        t.name = intern(targ.target_name);
+        t.first_tu = (uint32_t)tus.size();
+        t.link_hash = tables[n]->link_hash;
+        t.link_peak_kb = tables[n]->link_peak_kb;
+
+        std::vector<std::string> sources = targ.src_files;
+        if (targ.pch_header.size()) sources.push_back(pch_source_file(conf, targ));
+
+        for (const auto& src : sources) {
+            tu_record rec;
+            if (!tables[n]->find(src, rec)) continue;
+
+            state_tu tu = {};
+            tu.src = intern(src);
+            tu.first_dep = (uint32_t)deps.size();
+            tu.num_deps = (uint32_t)rec.deps.size();
+            tu.pre_hash = rec.pre_hash;
+            tu.src_hash = rec.src_hash;
+            tu.src_mtime   = rec.src_stamp.mtime;
+            tu.src_size    = rec.src_stamp.size;
+            tu.src_file_id = rec.src_stamp.file_id;
+            tu.cmd_hash = rec.cmd_hash;
+            tu.compile_ms = rec.compile_ms;
+            tu.peak_rss_kb = rec.peak_rss_kb;
+            tus.push_back(tu);
+            add_deps(rec.deps);
+        }
+
+        t.num_tus = (uint32_t)tus.size() - t.first_tu;
+        t.first_input = (uint32_t)deps.size();
+        t.num_inputs = (uint32_t)tables[n]->link_inputs.size();
+        add_deps(tables[n]->link_inputs);
+        targets.push_back(t);
+    }
+
+    std::vector<state_dir> dirs;
+    std::vector<state_dir_entry> dir_entries;
+    {
+        std::lock_guard<std::mutex> guard(discovery_cache.lock);
+        for (const auto& it : discovery_cache.dirs) {
+            if (!it.second.visited || !it.second.mtime) continue;
+
+            state_dir d = {};
+            d.path = intern(it.first);
+            d.first_entry = (uint32_t)dir_entries.size();
+            d.num_entries = (uint32_t)it.second.entries.size();
+            d.mtime = it.second.mtime;
+            dirs.push_back(d);
+            for (const auto& e : it.second.entries) {
+                dir_entries.push_back({ intern(e.name), e.is_dir ? 1u : 0u });
+            }
+        }
+    }
+
+    state_header h = {};
+    h.magic        = state_magic;
+    h.version      = state_version;
+    h.num_strings  = (uint32_t)string_offsets.size();
+    h.num_targets  = (uint32_t)targets.size();
+    h.num_tus      = (uint32_t)tus.size();
+    h.num_deps     = (uint32_t)deps.size();
+    h.num_dirs     = (uint32_t)dirs.size();
+    h.num_dir_entries = (uint32_t)dir_entries.size();
+    size_t strings_at = sizeof(state_header) + string_offsets.size() * sizeof(uint32_t);
+    strings.resize(align8(strings_at + strings.size()) - strings_at, 0);
+    h.string_bytes = (uint32_t)strings.size();
+
+    std::string filename = build_state_file(conf);
+    std::string tmp_name = filename + ".tmp";
+    FILE* fid = fopen(tmp_name.c_str(), "wb");
+    if (!fid) return false;
+
+    bool ok = fwrite(&h, sizeof(h), 1, fid) == 1;
+    if (string_offsets.size()) ok = ok && fwrite(string_offsets.data(), sizeof(uint32_t), string_offsets.size(), fid) == string_offsets.size();
+    if (strings.size())        ok = ok && fwrite(strings.data(), 1, strings.size(), fid) == strings.size();
+    if (targets.size())        ok = ok && fwrite(targets.data(), sizeof(state_target), targets.size(), fid) == targets.size();
+    if (tus.size())            ok = ok && fwrite(tus.data(), sizeof(state_tu), tus.size(), fid) == tus.size();
+    if (deps.size())           ok = ok && fwrite(deps.data(), sizeof(state_dep), deps.size(), fid) == deps.size();
+    if (dirs.size())           ok = ok && fwrite(dirs.data(), sizeof(state_dir), dirs.size(), fid) == dirs.size();
+    if (dir_entries.size())    ok = ok && fwrite(dir_entries.data(), sizeof(state_dir_entry), dir_entries.size(), fid) == dir_entries.size();
+    ok = (fclose(fid) == 0) && ok;
+
+    // windows won't replace a file that is still mapped
+    close_build_state(state);
+
+    if (!ok || !replace_file(tmp_name, filename)) {
+        delete_file(tmp_name);
+        return false;
+    }
+    return true;
+}
+
+// print a state file as text, for debugging. see tools/dump_state.cpp
+int dump_build_state(const std::string& filename) {
+    build_state state;
+    if (!open_build_state(state, filename)) {
+        printf("[%s] is not a build state file (or has a different version)\n", filename.c_str());
+        return -1;
+    }
+
+    const state_header& h = *state.header;
+    printf("%s: version %u, %u strings, %u targets, %u tus, %u deps, %u cached dirs\n",
+           filename.c_str(), h.version, h.num_strings, h.num_targets, h.num_tus, h.num_deps, h.num_dirs);
+
+    for (uint32_t n = 0; n < h.num_targets; n++) {
+        const state_target& t = state.targets[n];
+        printf("target [%s] link_cmd %016llx  link peak %uKB\n", state_string(state, t.name), (unsigned long long)t.link_hash, t.link_peak_kb);
+
+        for (uint32_t k = 0; k < t.num_inputs; k++) {
+            const state_dep& in = state.deps[t.first_input + k];
+            printf("  link input %s\n", state_string(state, in.path));
+            printf("    hash %016llx%016llx  mtime %llu  size %llu  id %llu\n",
+                   (unsigned long long)in.hash.hi, (unsigned long long)in.hash.lo,
+                   (unsigned long long)in.mtime, (unsigned long long)in.size, (unsigned long long)in.file_id);
+        }
+
+        for (uint32_t k = 0; k < t.num_tus; k++) {
+            const state_tu& tu = state.tus[t.first_tu + k];
+            printf("  %s\n", state_string(state, tu.src));
+            printf("    pre %016llx%016llx  src %016llx%016llx  cmd %016llx\n",
+                   (unsigned long long)tu.pre_hash.hi, (unsigned long long)tu.pre_hash.lo,
+                   (unsigned long long)tu.src_hash.hi, (unsigned long long)tu.src_hash.lo,
+                   (unsigned long long)tu.cmd_hash);
+            printf("    mtime %llu  size %llu  id %llu  compile %ums  peak %uKB\n",
+                   (unsigned long long)tu.src_mtime, (unsigned long long)tu.src_size, (unsigned long long)tu.src_file_id, tu.compile_ms, tu.peak_rss_kb);
+
+            for (uint32_t d = 0; d < tu.num_deps; d++) {
+                const state_dep& dep = state.deps[tu.first_dep + d];
+                printf("    dep %s\n", state_string(state, dep.path));
+                printf("      hash %016llx%016llx  mtime %llu  size %llu  id %llu\n",
+                       (unsigned long long)dep.hash.hi, (unsigned long long)dep.hash.lo,
+                       (unsigned long long)dep.mtime, (unsigned long long)dep.size, (unsigned long long)dep.file_id);
+            }
+        }
+    }
+
+    close_build_state(state);
+    return 0;
+}
+
+// how a file's contents are boiled down to a hash128: hash_file, or hash_link_input for link inputs
+typedef bool (*file_hasher)(const std::string& filename, hash128& out);
+
+/* true if a file still has the contents it had when `stamp` and `hash` were recorded.
+* only files whose metadata moved get hashed. if the contents turn out to be the same
+* (e.g. the file was just touched), the new metadata is written back into `stamp`.
+*/
+bool file_unchanged(const std::string& filename, file_stamp& stamp, const hash128& hash, bool& stamp_updated, file_hasher hasher = hash_file) {
+    file_stamp current;
+    if (!stat_file(filename, current)) return false;
+    if (same_stamp(current, stamp)) return true;
+
+    hash128 h;
+    if (!hasher(filename, h) || !same_hash(h, hash)) return false;
+
+    stamp = current;
+    stamp_updated = true;
+    return true;
+}
+
+// true if the source and every header it was last compiled with are unchanged
+bool inputs_unchanged(tu_record& rec, const std::string& src, bool& stamps_updated) {
+    if (!file_unchanged(src, rec.src_stamp, rec.src_hash, stamps_updated)) return false;
+
+    for (auto& d : rec.deps) {
+        if (!file_unchanged(d.path, d.stamp, d.hash, stamps_updated)) return false;
+    }
+    return true;
+}
+
+// stat + hash the headers the compiler reported, so the next build can compare against them
+bool hash_deps(const std::vector<std::string>& includes, std::vector<dep_info>& deps, file_hasher hasher = hash_file) {
+    deps.clear();
+    for (const auto& inc : includes) {
+        dep_info dep;
+        dep.path = inc;
+        if (!stat_file(inc, dep.stamp)) return false;
+        if (!hasher(inc, dep.hash)) return false;
+        deps.push_back(dep);
+    }
+    return true;
+}
+
+/* interface hashes of link inputs.
+* relinking a shared_lib rewrites its import lib (or the .so itself) even when it exports exactly
+* the same things, and objects carry the time they were compiled at. so link inputs are hashed
+* by what the linker reads from them, and a dependent is only relinked when that changes
+* (ninja calls this "restat"):
+*   archives (.lib/.a)  import members by symbol, dll and import type; other members by contents
+*   COFF objects        contents without the TimeDateStamp
+*   ELF shared objects  soname + every exported dynamic symbol (name, type, binding, size of data)
+* anything else is hashed by contents.
+*/
+uint16_t read_u16(const char* p) { uint16_t v; memcpy(&v, p, sizeof(v)); return v; }
+uint32_t read_u32(const char* p) { uint32_t v; memcpy(&v, p, sizeof(v)); return v; }
+uint64   read_u64(const char* p) { uint64 v;   memcpy(&v, p, sizeof(v)); return v; }
+
+bool is_coff_object(const char* data, size_t size) {
+    if (size < 20) return false;
+    uint16_t machine = read_u16(data);
+    return machine == 0x14c || machine == 0x8664 || machine == 0xaa64 || machine == 0x1c4;
+}
+
+void hash_coff_object(hash_state& st, const char* data, size_t size) {
+    // file header: Machine, NumberOfSections, then the 4 byte TimeDateStamp
+    hash_update(st, data, 4);
+    hash_update(st, data + 8, size - 8);
+}
+
+bool hash_archive_interface(const char* data, size_t size, hash128& out) {
+    hash_state st;
+    hash_init(st);
+
+    // "!<arch>\n", then members: a 60 byte header (decimal size at 48, "`\n" at 58), data padded to 2 bytes
+    size_t pos = 8;
+    while (pos + 60 <= size) {
+        const char* header = data + pos;
+        if (header[58] != '`' || header[59] != '\n') return false;
+
+        uint64 member_size = strtoull(std::string(header + 48, 10).c_str(), NULL, 10);
+        if (member_size > size - pos - 60) return false;
+        const char* member = header + 60;
+        pos += 60 + member_size + (member_size & 1);
+
+        // the symbol tables ("/", "/SYM64/", "__.SYMDEF") and long name table ("//") follow from the rest
+        bool index = (header[0] == '/' && (header[1] == ' ' || header[1] == '/' || memcmp(header, "/SYM64/", 7) == 0)) ||
+                     memcmp(header, "__.SYMDEF", 9) == 0;
+        if (index) continue;
+
+        if (member_size >= 20 && read_u16(member) == 0 && read_u16(member + 2) == 0xFFFF && read_u16(member + 4) == 0) {
+            // short import object: Machine at 6, TimeDateStamp at 8, SizeOfData at 12,
+            // Ordinal/Hint at 16, Type/NameType at 18, then "symbol\0dll\0"
+            uint16_t type_info = read_u16(member + 18);
+            uint32_t data_size = read_u32(member + 12);
+            if (data_size > member_size - 20) return false;
+
+            hash_update(st, member + 6, 2);
+            hash_update(st, &type_info, sizeof(type_info));
+            // imported by ordinal (NameType 0): the number is the interface. otherwise it's only a lookup hint.
+            if (((type_info >> 2) & 7) == 0) hash_update(st, member + 16, 2);
+            hash_update(st, member + 20, data_size);
+        } else if (is_coff_object(member, member_size)) {
+            hash_coff_object(st, member, member_size);
+        } else {
+            hash_update(st, member, member_size);
+        }
+    }
+
+    out = hash_final(st);
+    return true;
+}
+
+bool hash_elf_interface(const char* data, size_t size, hash128& out) {
+    // 64-bit little-endian shared objects (ET_DYN) only
+    if (size < 64 || data[4] != 2 || data[5] != 1 || read_u16(data + 16) != 3) return false;
+
+    uint64 shoff = read_u64(data + 40);
+    uint16_t shentsize = read_u16(data + 58);
+    uint16_t shnum = read_u16(data + 60);
+    if (shentsize != 64 || shoff > size || (uint64)shnum * 64 > size - shoff) return false;
+
+    auto section = [&](uint32_t n) { return data + shoff + (uint64)n * 64; };
+    auto in_file = [&](uint64 offset, uint64 len) { return offset <= size && len <= size - offset; };
+
+    std::vector<std::string> entries;
+    for (uint32_t n = 0; n < shnum; n++) {
+        const char* sh = section(n);
+        uint32_t type = read_u32(sh + 4);
+        if (type != 11 && type != 6) continue; // SHT_DYNSYM, SHT_DYNAMIC
+
+        uint64 offset = read_u64(sh + 24);
+        uint64 len = read_u64(sh + 32);
+        uint32_t link = read_u32(sh + 40);
+        if (link >= shnum || !in_file(offset, len)) return false;
+
+        const char* strtab = data + read_u64(section(link) + 24);
+        uint64 strtab_size = read_u64(section(link) + 32);
+        if (!in_file(read_u64(section(link) + 24), strtab_size)) return false;
+        auto name_at = [&](uint64 off) { return off < strtab_size ? std::string(strtab + off, strnlen(strtab + off, strtab_size - off)) : std::string(); };
+
+        if (type == 6) {
+            for (uint64 d = 0; d + 16 <= len; d += 16) {
+                if (read_u64(data + offset + d) == 14) entries.push_back("soname " + name_at(read_u64(data + offset + d + 8))); // DT_SONAME
+            }
+            continue;
+        }
+
+        for (uint64 sym = 0; sym + 24 <= len; sym += 24) {
+            const char* s = data + offset + sym;
+            uint8_t info = (uint8_t)s[4];
+            uint8_t visibility = (uint8_t)s[5] & 3;
+            uint16_t shndx = read_u16(s + 6);
+            uint8_t bind = info >> 4;
+            uint8_t sym_type = info & 0xf;
+
+            // only defined, visible globals are part of the interface
+            if (shndx == 0 || visibility == 1 || visibility == 2) continue;
+            if (bind != 1 && bind != 2 && bind != 10) continue; // GLOBAL, WEAK, GNU_UNIQUE
+
+            std::string entry = name_at(read_u32(s));
+            entry += '\0';
+            entry += (char)sym_type;
+            entry += (char)bind;
+            // copy relocations bake in the size of exported data
+            if (sym_type == 1 || sym_type == 6) entry.append(s + 16, 8); // OBJECT, TLS
+            entries.push_back(entry);
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+
+    hash_state st;
+    hash_init(st);
+    for (const auto& e : entries) {
+        hash_update(st, e.data(), e.size());
+        hash_update(st, "\n", 1);
+    }
+    out = hash_final(st);
+    return true;
+}
+
+bool hash_link_input(const std::string& filename, hash128& out) {
+    trace_scope trace("hash", filename);
+    mapped_file m;
+    if (!map_file(filename, m)) return hash_file(filename, out);
+
+    bool ok = false;
+    if (m.size >= 8 && memcmp(m.data, "!<arch>\n", 8) == 0) {
+        ok = hash_archive_interface(m.data, m.size, out);
+    } else if (m.size >= 4 && memcmp(m.data, "\x7f" "ELF", 4) == 0) {
+        ok = hash_elf_interface(m.data, m.size, out);
+    } else if (is_coff_object(m.data, m.size)) {
+        hash_state st;
+        hash_init(st);
+        hash_coff_object(st, m.data, m.size);
+        out = hash_final(st);
+        ok = true;
+    }
+    unmap_file(m);
+
+    return ok || hash_file(filename, out);
+}
+
+// what a target's link reads: its objects, and every link_lib found on disk (in link_dir,
+// e.g. another target's import lib). system libs aren't files we can see, the command covers those.
+std::vector<std::string> link_input_files(const project_config& conf, const target_config& targ) {
+    std::vector<std::string> inputs;
+    for (const auto& src : targ.src_files) {
+        inputs.push_back(obj_file_for(conf, targ, src));
+    }
+    // only cl.exe's pch comes with an object
+    if (targ.pch_header.size() && !gnu_toolchain(conf)) {
+        inputs.push_back(obj_file_for(conf, targ, pch_source_file(conf, targ)));
+    }
+    for (const auto& lib : targ.link_libs) {
+        std::string dir = targ.link_dir.size() ? targ.link_dir + path_sep : "";
+        if (gnu_toolchain(conf)) {
+            // what the linker finds for -l<name>: the shared lib if there is one, the archive otherwise
+            std::string arg = gnu_link_lib(lib);
+            if (arg.compare(0, 2, "-l") == 0 && arg.compare(0, 3, "-l:") != 0) {
+                std::string name = dir + "lib" + arg.substr(2);
+                if (file_exists(name + ".so"))     inputs.push_back(name + ".so");
+                else if (file_exists(name + ".a")) inputs.push_back(name + ".a");
+                continue;
+            }
+            if (arg[0] == '-') continue;
+        }
+        std::string path = dir + lib;
+        if (file_exists(path)) inputs.push_back(path);
+    }
+    if (conf.pgo == pgo_use) {
+        inputs.push_back(pgo_profile_id_file(conf));
+    }
+    return inputs;
+}
+
+// true if the link would read the same files, with the same interface, as last time
+bool link_inputs_unchanged(std::vector<dep_info>& recorded, const std::vector<std::string>& inputs, bool& stamps_updated) {
+    if (recorded.size() != inputs.size()) return false;
+
+    for (size_t n = 0; n < inputs.size(); n++) {
+        if (recorded[n].path != inputs[n]) return false;
+        if (!file_unchanged(inputs[n], recorded[n].stamp, recorded[n].hash, stamps_updated, hash_link_input)) return false;
+    }
+    return true;
+}
+
+/* local object cache (opt-in, see project_config::object_cache_dir).
+* compiled objects are stored under a key made from the hash of the preprocessed source
+* plus the compile command, so the same input compiled with the same flags is only ever
+* compiled once, no matter which target, obj_dir or checkout it comes from.
+* each entry is two files: <key>.obj and <key>.deps (the headers /showIncludes reported).
+*/
+std::atomic<int> object_cache_hits(0);
+std::atomic<int> object_cache_misses(0);
+
+std::string object_cache_key(const project_config& conf, const target_config& targ, const std::string& src, const hash128& pre_hash) {
+    // the preprocessed hash already covers the source and include paths,
+    // so leave out everything that only differs between checkouts / obj_dirs
+    command_args cmd = generate_compile_cmd(conf, targ, src);
+    command_args key_args;
+    for (size_t n = 0; n < cmd.size(); n++) {
+        if (cmd[n] == src) continue;
+        if (cmd[n] == "/Fo:" || cmd[n] == "-o" || cmd[n] == "-MF") {
+            n++;
+            continue;
+        }
+
+        bool is_include = false;
+        for (const auto& dir : targ.include_dirs) {
+            if (cmd[n] == "/I" + dir || cmd[n] == "-I" + dir) is_include = true;
+        }
+        if (!is_include) key_args.push_back(cmd[n]);
+    }
+
+    return format_str("%016llx%016llx_%016llx",
+                      (unsigned long long)pre_hash.hi, (unsigned long long)pre_hash.lo,
+                      (unsigned long long)hash_command(key_args));
+}
+
+// bump the last-write time, which is what trim_object_cache() evicts by
+void touch_file(const std::string& filename) {
+#ifdef _WIN32
+    HANDLE file = CreateFileA(filename.c_str(), FILE_WRITE_ATTRIBUTES, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                              NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (file == INVALID_HANDLE_VALUE) return;
+
+    FILETIME now;
+    GetSystemTimeAsFileTime(&now);
+    SetFileTime(file, NULL, NULL, &now);
+    CloseHandle(file);
+#else
+    utimensat(AT_FDCWD, filename.c_str(), NULL, 0);
+#endif
+}
+
+// copy to a temp name first, so other builds never see a half-written entry
+bool copy_file_atomic(const std::string& from, const std::string& to) {
+    std::string tmp = to + format_str(".%u.tmp", (unsigned int)std::hash<std::thread::id>()(std::this_thread::get_id()));
+    if (!copy_file(from, tmp)) return false;
+    if (!replace_file(tmp, to)) {
+        delete_file(tmp);
+        return false;
+    }
+    return true;
+}
+
+bool object_cache_fetch(const project_config& conf, const std::string& key, const std::string& obj_file, std::vector<std::string>& includes) {
+    std::string entry = conf.object_cache_dir + path_sep + key;
+
+    std::ifstream fid(entry + ".deps");
+    if (!fid.is_open() || !file_exists(entry + ".obj")) {
+        return false;
+    }
+
+    includes.clear();
+    std::string line;
+    while (std::getline(fid, line)) {
+        if (line.size()) includes.push_back(line);
+    }
+    fid.close();
+
+    // hard link if we can (same volume), copy otherwise
+    delete_file(obj_file);
+    if (!hard_link_file(entry + ".obj", obj_file) && !copy_file(entry + ".obj", obj_file)) {
+        return false;
+    }
+
+    touch_file(entry + ".obj");
+    touch_file(entry + ".deps");
+    return true;
+}
+
+void object_cache_store(const project_config& conf, const std::string& key, const std::string& obj_file, const std::vector<std::string>& includes) {
+    std::string entry = conf.object_cache_dir + path_sep + key;
+
+    std::string tmp_deps = entry + format_str(".%u.deps.tmp", (unsigned int)std::hash<std::thread::id>()(std::this_thread::get_id()));
+    FILE* fid = fopen(tmp_deps.c_str(), "w");
+    if (!fid) return;
+    for (const auto& inc : includes) {
+        fprintf(fid, "%s\n", inc.c_str());
+    }
+    fclose(fid);
+
+    if (!replace_file(tmp_deps, entry + ".deps")) {
+        delete_file(tmp_deps);
+        return;
+    }
+
+    copy_file_atomic(obj_file, entry + ".obj");
+}
+
+// evict least-recently-used entries until the cache fits in object_cache_max_mb again
+void trim_object_cache(const project_config& conf) {
+    struct cache_file {
+        std::string name;
+        uint64 mtime;
+        uint64 size;
+    };
+
+    std::vector<cache_file> files;
+    uint64 total = 0;
+
+#ifdef _WIN32
+    std::string search = conf.object_cache_dir + "\\*";
+    WIN32_FIND_DATA data;
+    HANDLE hFind = FindFirstFileA(search.c_str(), &data);
+    if (hFind == INVALID_HANDLE_VALUE) return;
+    do {
+        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) continue;
+
+        cache_file f;
+        f.name  = conf.object_cache_dir + path_sep + data.cFileName;
+        f.mtime = ((uint64)data.ftLastWriteTime.dwHighDateTime << 32) | data.ftLastWriteTime.dwLowDateTime;
+        f.size  = ((uint64)data.nFileSizeHigh << 32) | data.nFileSizeLow;
+        total += f.size;
+        files.push_back(f);
+    } while (FindNextFileA(hFind, &data));
+    FindClose(hFind);
+#else
+    DIR* dir = opendir(conf.object_cache_dir.c_str());
+    if (!dir) return;
+    while (dirent* ent = readdir(dir)) {
+        cache_file f;
+        f.name = conf.object_cache_dir + "/" + ent->d_name;
+
+        struct stat st;
+        if (stat(f.name.c_str(), &st) != 0 || !S_ISREG(st.st_mode)) continue;
+        f.mtime = (uint64)st.st_mtim.tv_sec * 1000000000ull + (uint64)st.st_mtim.tv_nsec;
+        f.size  = (uint64)st.st_size;
+        total += f.size;
+        files.push_back(f);
+    }
+    closedir(dir);
+#endif
+
+    uint64 limit = (uint64)conf.object_cache_max_mb * 1024 * 1024;
+    if (total <= limit) return;
+
+    // trim a bit below the limit, so the next few builds don't have to trim again
+    uint64 target = limit - limit / 10;
+    std::sort(files.begin(), files.end(), [](const cache_file& a, const cache_file& b) { return a.mtime < b.mtime; });
+    for (const auto& f : files) {
+        if (total <= target) break;
+        if (delete_file(f.name)) total -= f.size;
+    }
+}
+
+/* run the preprocessor over src and hash what it produces.
+* normally the output is hashed chunk by chunk as it comes out of the pipe, so nothing is
+* written to disk and memory use doesn't depend on how big the translation unit is.
+*/
+int preprocess_and_hash(const project_config& conf, const target_config& targ, const std::string& src, hash128& out, std::string& log) {
+    std::string pre_file;
+    command_args cmd = generate_preprocess_cmd(conf, targ, src, pre_file);
+
+    trace_scope trace("preprocess", src);
+    std::string std_out, std_err;
+    int res;
+
+    hash_state st;
+    hash_init(st);
+    if (conf.keep_preprocessed_files) {
+        res = run_command(cmd, std_out, std_err);
+    } else {
+        res = run_command_streamed(cmd, [&st](const char* data, size_t len) {
+            hash_update(st, data, len);
+        }, std_err);
+    }
+
+    if (res) {
+        trace.exit_code = res;
+        log += format_str("Failed! ErrorCode: %d\n", res);
+        log += std_out + "\n";
+        log += std_err + "\n";
+        return res;
+    }
+
+    if (conf.keep_preprocessed_files) {
+        if (!hash_file_contents(pre_file, out)) {
+            log += format_str("error hashing [%s]\n", pre_file.c_str());
+            return -1;
+        }
+    } else {
+        out = hash_final(st);
+    }
+    return 0;
+}
+
+/* distributed compiles (see project_config::remote_workers).
+* a source is preprocessed here, and the output is sent with its compile command to a
+* tools/build_worker.cpp process, which compiles it and sends back the object and the diagnostics.
+* the headers it read come from the local preprocess, so the worker needs nothing but a compiler.
+* one request and one reply per connection, integers are little-endian, strings a u64 length + bytes:
+*   request: "BLD1", u32 arg count, the args, input file name, input
+*   reply:   "BLD1", i32 exit code, stdout, stderr, object
+* "{in}" and "{out}" in the args are replaced with the worker's temp files.
+*/
+static const char* build_worker_port = "7787";
+
+#ifdef _WIN32
+typedef SOCKET net_socket;
+static const net_socket net_invalid = INVALID_SOCKET;
+#else
+typedef int net_socket;
+static const net_socket net_invalid = -1;
+#endif
+
+void net_startup() {
+#ifdef _WIN32
+    static std::once_flag once;
+    std::call_once(once, []() {
+        WSADATA wsa;
+        WSAStartup(MAKEWORD(2, 2), &wsa);
+    });
+#endif
+}
+
+void net_close(net_socket s) {
+#ifdef _WIN32
+    closesocket(s);
+#else
+    close(s);
+#endif
+}
+
+void net_set_blocking(net_socket s, bool blocking) {
+#ifdef _WIN32
+    u_long mode = blocking ? 0 : 1;
+    ioctlsocket(s, FIONBIO, &mode);
+#else
+    int flags = fcntl(s, F_GETFL, 0);
+    fcntl(s, F_SETFL, blocking ? (flags & ~O_NONBLOCK) : (flags | O_NONBLOCK));
+#endif
+}
+
+// a send or receive that takes longer than this fails
+void net_set_timeout(net_socket s, unsigned int seconds) {
+#ifdef _WIN32
+    DWORD ms = seconds * 1000;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (const char*)&ms, sizeof(ms));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (const char*)&ms, sizeof(ms));
+#else
+    timeval tv = {};
+    tv.tv_sec = seconds;
+    setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+#endif
+}
+
+// "host:port", or just "host" for the default port
+void split_host_port(const std::string& addr, std::string& host, std::string& port) {
+    size_t colon = addr.find_last_of(':');
+    host = colon == std::string::npos ? addr : addr.substr(0, colon);
+    port = colon == std::string::npos ? build_worker_port : addr.substr(colon + 1);
+}
+
+// gives up after connect_ms, so a machine that is gone doesn't hold up the build
+net_socket net_connect(const std::string& addr, unsigned int connect_ms) {
+    net_startup();
+
+    std::string host, port;
+    split_host_port(addr, host, port);
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* found = NULL;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &found) != 0) return net_invalid;
+
+    net_socket s = net_invalid;
+    for (addrinfo* ai = found; ai && s == net_invalid; ai = ai->ai_next) {
+        s = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (s == net_invalid) continue;
+
+        net_set_blocking(s, false);
+        bool ok = connect(s, ai->ai_addr, (int)ai->ai_addrlen) == 0;
+        if (!ok) {
+            fd_set writable, failed;
+            FD_ZERO(&writable);
+            FD_ZERO(&failed);
+            FD_SET(s, &writable);
+            FD_SET(s, &failed);
+            timeval tv = {};
+            tv.tv_sec  = connect_ms / 1000;
+            tv.tv_usec = (connect_ms % 1000) * 1000;
+
+            int err = 0;
+            socklen_t len = sizeof(err);
+            ok = select((int)s + 1, NULL, &writable, &failed, &tv) > 0 && FD_ISSET(s, &writable) &&
+                 getsockopt(s, SOL_SOCKET, SO_ERROR, (char*)&err, &len) == 0 && err == 0;
+        }
+        net_set_blocking(s, true);
+
+        if (!ok) {
+            net_close(s);
+            s = net_invalid;
+        }
+    }
+    freeaddrinfo(found);
+
+    if (s != net_invalid) {
+        int one = 1;
+        setsockopt(s, IPPROTO_TCP, TCP_NODELAY, (const char*)&one, sizeof(one));
+    }
+    return s;
+}
+
+bool net_send_all(net_socket s, const char* data, size_t len) {
+#ifdef MSG_NOSIGNAL
+    const int flags = MSG_NOSIGNAL; // a closed connection is an error, not a SIGPIPE
+#else
+    const int flags = 0;
+#endif
+    while (len) {
+        int chunk = (int)(std::min)(len, (size_t)(1 << 20));
+        int sent = send(s, data, chunk, flags);
+        if (sent <= 0) return false;
+        data += sent;
+        len -= sent;
+    }
+    return true;
+}
+
+bool net_recv_all(net_socket s, char* data, size_t len) {
+    while (len) {
+        int chunk = (int)(std::min)(len, (size_t)(1 << 20));
+        int got = recv(s, data, chunk, 0);
+        if (got <= 0) return false;
+        data += got;
+        len -= got;
+    }
+    return true;
+}
+
+struct wire_writer {
+    std::string buf;
+
+    void u32(uint32_t v) {
+        for (int n = 0; n < 4; n++) buf += (char)(v >> (8 * n));
+    }
+    void u64(uint64 v) {
+        for (int n = 0; n < 8; n++) buf += (char)(v >> (8 * n));
+    }
+    void str(const std::string& s) {
+        u64(s.size());
+        buf += s;
+    }
+};
+
+bool net_recv_u32(net_socket s, uint32_t& v) {
+    unsigned char b[4];
+    if (!net_recv_all(s, (char*)b, 4)) return false;
+    v = b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32_t)b[3] << 24);
+    return true;
+}
+
+bool net_recv_str(net_socket s, std::string& str) {
+    unsigned char b[8];
+    if (!net_recv_all(s, (char*)b, 8)) return false;
+    uint64 len = 0;
+    for (int n = 0; n < 8; n++) len |= (uint64)b[n] << (8 * n);
+    if (len > (1ull << 32)) return false; // nothing we send is this big
+
+    str.resize((size_t)len);
+    return len == 0 || net_recv_all(s, &str[0], (size_t)len);
+}
+
+bool net_recv_magic(net_socket s) {
+    char magic[4];
+    return net_recv_all(s, magic, 4) && memcmp(magic, "BLD1", 4) == 0;
+}
+
+/* compile slots: max_jobs local ones, plus remote_slots per worker. a compile takes a free local
+* slot first, then the least busy worker that is up, and otherwise waits for one to free up.
+* a worker that fails is left alone for remote_retry_s.
+*/
+struct remote_worker {
+    std::string addr;
+    unsigned int busy = 0;
+    uint64 down_until_us = 0;
+};
+
+struct compile_slot_pool {
+    std::mutex lock;
+    std::condition_variable freed;
+    unsigned int local_free = 0;
+    unsigned int per_worker = 0;
+    unsigned int retry_s = 0;
+    std::vector<remote_worker> workers;
+
+    void reset(const project_config& conf) {
+        std::lock_guard<std::mutex> guard(lock);
+        local_free = get_job_count(conf);
+        per_worker = conf.remote_slots;
+        retry_s = conf.remote_retry_s;
+        workers.clear();
+        for (const auto& addr : conf.remote_workers) {
+            remote_worker w;
+            w.addr = addr;
+            workers.push_back(w);
+        }
+    }
+
+    // -1 for a local slot, otherwise the index of the worker
+    int acquire(bool allow_remote) {
+        std::unique_lock<std::mutex> guard(lock);
+        while (true) {
+            if (local_free) {
+                local_free--;
+                return -1;
+            }
+            if (allow_remote) {
+                uint64 now = trace_now_us();
+                int best = -1;
+                for (int n = 0; n < (int)workers.size(); n++) {
+                    const remote_worker& w = workers[n];
+                    if (w.down_until_us > now || w.busy >= per_worker) continue;
+                    if (best < 0 || w.busy < workers[best].busy) best = n;
+                }
+                if (best >= 0) {
+                    workers[best].busy++;
+                    return best;
+                }
+            }
+            freed.wait(guard);
+        }
+    }
+
+    void release(int slot, bool worker_ok) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (slot < 0) {
+            local_free++;
+        } else {
+            workers[slot].busy--;
+            if (!worker_ok) workers[slot].down_until_us = trace_now_us() + (uint64)retry_s * 1000000;
+        }
+        freed.notify_all();
+    }
+};
+
+compile_slot_pool compile_slots;
+std::atomic<int> remote_compiles(0);
+std::atomic<int> remote_fallbacks(0);
+
+// how many more compiles can run at once with the workers
+unsigned int remote_slot_count(const project_config& conf) {
+    return (unsigned int)conf.remote_workers.size() * conf.remote_slots;
+}
+
+// what the worker runs: the compile command without what the preprocessor already did
+// (include dirs, defines, the depfile), reading "{in}" and writing "{out}"
+command_args remote_compile_cmd(const project_config& conf, const command_args& compile_cmd, const std::string& src) {
+    command_args args;
+    for (size_t n = 0; n < compile_cmd.size(); n++) {
+        const std::string& a = compile_cmd[n];
+        if (a == src || a == "/showIncludes" || a == "-MD") continue;
+        if (a == "-MF" || a == "-o" || a == "/Fo:") {
+            n++;
+            continue;
+        }
+        if (a.compare(0, 2, "-I") == 0 || a.compare(0, 2, "-D") == 0 ||
+            a.compare(0, 2, "/I") == 0 || a.compare(0, 2, "/D") == 0) continue;
+        args.push_back(a);
+    }
+
+    if (gnu_toolchain(conf)) {
+        add_flags(args, "-x c++-cpp-output");
+        args.push_back("{in}");
+        args.push_back("-o");
+        args.push_back("{out}");
+    } else {
+        args.push_back("/Tp{in}");
+        args.push_back("/Fo:");
+        args.push_back("{out}");
+    }
+    return args;
+}
+
+// the compile command, stopped after the preprocessor (-E, /E to stdout). flags that define macros
+// themselves (/MTd, /LD, -O2, -fPIC, -flto, ...) stay in, so the worker compiles the same text a local
+// compile would. the -MD depfile or the /showIncludes notes (on stderr) still list the headers.
+command_args remote_preprocess_cmd(const command_args& compile_cmd) {
+    command_args args;
+    for (size_t n = 0; n < compile_cmd.size(); n++) {
+        const std::string& a = compile_cmd[n];
+        if (a == "-o" || a == "/Fo:") {
+            n++;
+            continue;
+        }
+        if      (a == "-c") args.push_back("-E");
+        else if (a == "/c") args.push_back("/E");
+        else                args.push_back(a);
+    }
+    return args;
+}
+
+// the output of remote_preprocess_cmd and the headers it read. compile_file_incremental hashes the
+// same text it ships, so a remote compile runs the preprocessor once.
+struct preprocessed_source {
+    bool done = false;
+    std::string text;
+    std::vector<std::string> includes;
+};
+
+// `worker_ok` is false if the worker couldn't be used at all, the caller compiles locally then.
+// a compile that fails on the worker is an error like any other.
+int remote_compile(const project_config& conf, const std::string& src, const command_args& compile_cmd,
+                   const std::string& worker, const std::string& obj_file, const preprocessed_source& pre,
+                   std::string& std_out, std::string& std_err, bool& worker_ok) {
+    worker_ok = true;
+
+    wire_writer req;
+    req.buf = "BLD1";
+    command_args args = remote_compile_cmd(conf, compile_cmd, src);
+    req.u32((uint32_t)args.size());
+    for (const auto& a : args) req.str(a);
+    req.str(file_stem(src) + (gnu_toolchain(conf) ? ".ii" : ".i"));
+    req.str(pre.text);
+
+    trace_scope trace("remote", src);
+    net_socket s = net_connect(worker, 2000);
+    if (s == net_invalid) {
+        worker_ok = false;
+        return -1;
+    }
+    net_set_timeout(s, conf.remote_timeout_s);
+
+    uint32_t exit_code = 0;
+    std::string object;
+    worker_ok = net_send_all(s, req.buf.data(), req.buf.size()) && net_recv_magic(s) && net_recv_u32(s, exit_code) &&
+                net_recv_str(s, std_out) && net_recv_str(s, std_err) && net_recv_str(s, object);
+    net_close(s);
+    if (!worker_ok) {
+        std_out.clear();
+        std_err.clear();
+        return -1;
+    }
+
+    int res = (int)exit_code;
+    trace.exit_code = res;
+    if (res) return res;
+
+    // a new file, the old one may be a hard link into the object cache
+    std::string tmp = obj_file + ".remote.tmp";
+    std::ofstream out(tmp, std::ios::binary | std::ios::trunc);
+    out.write(object.data(), object.size());
+    out.close();
+    if (out.fail() || !replace_file(tmp, obj_file)) {
+        delete_file(tmp);
+        std_err += format_str("could not write [%s]\n", obj_file.c_str());
+        return -1;
+    }
+    return 0;
+}
+
+/* memory-aware scheduling (see project_config::memory_budget_mb).
+* an action reserves its estimated peak before it starts and gives it back when it ends.
+* one action always runs when nothing else does, however much it needs.
+*/
+struct memory_gate {
+    std::mutex lock;
+    std::condition_variable freed;
+    uint64 budget_kb = 0;
+    uint64 unknown_kb = 0;
+    uint64 in_use_kb = 0;
+    unsigned int running = 0;
+    uint64 max_seen_kb = 0; // kept between builds in watch mode
+    std::atomic<int> waits{0};
+
+    void reset(const project_config& conf) {
+        std::lock_guard<std::mutex> guard(lock);
+        budget_kb = (uint64)conf.memory_budget_mb * 1024;
+        unknown_kb = (uint64)conf.memory_unknown_mb * 1024;
+        in_use_kb = 0;
+        running = 0;
+        waits = 0;
+    }
+
+    void saw_peak(uint64 kb) {
+        std::lock_guard<std::mutex> guard(lock);
+        max_seen_kb = (std::max)(max_seen_kb, kb);
+    }
+
+    // what an action with this recorded peak (0: none) reserves
+    uint64 estimate(uint64 recorded_kb) {
+        std::lock_guard<std::mutex> guard(lock);
+        if (recorded_kb) return recorded_kb;
+        return (std::max)(unknown_kb, max_seen_kb);
+    }
+
+    void acquire(uint64 kb) {
+        if (!budget_kb) return;
+        std::unique_lock<std::mutex> guard(lock);
+        if (running && in_use_kb + kb > budget_kb) {
+            waits++;
+            freed.wait(guard, [&]() { return running == 0 || in_use_kb + kb <= budget_kb; });
+        }
+        in_use_kb += kb;
+        running++;
+    }
+
+    void release(uint64 kb) {
+        if (!budget_kb) return;
+        {
+            std::lock_guard<std::mutex> guard(lock);
+            in_use_kb -= kb;
+            running--;
+        }
+        freed.notify_all();
+    }
+};
+
+memory_gate memory_slots;
+
+// targets with a pch, split dwarf objects and pgo builds read files the worker doesn't have
+bool can_compile_remotely(const project_config& conf, const target_config& targ) {
+    return conf.remote_workers.size() && targ.pch_header.empty() && conf.pgo == pgo_off &&
+           !(gnu_toolchain(conf) && conf.split_debug_info && conf.generate_debug_info);
+}
+
+// run remote_preprocess_cmd for a source that may be compiled on a worker. it is a local process like
+// a compile, so it waits for the memory budget and a jobserver token the same way.
+int preprocess_for_remote(const project_config& conf, const std::string& src, const command_args& compile_cmd,
+                          const std::string& obj_file, const tu_record& rec, preprocessed_source& out, std::string& std_err) {
+    uint64 reserved_kb = memory_slots.estimate(rec.peak_rss_kb);
+    memory_slots.acquire(reserved_kb);
+    job_token token;
+    jobserver_acquire(token);
+
+    int res;
+    {
+        trace_scope trace("preprocess", src);
+        res = run_command(remote_preprocess_cmd(compile_cmd), out.text, std_err);
+        trace.exit_code = res;
+    }
+    jobserver_release(token);
+    memory_slots.release(reserved_kb);
+    if (res) return res;
+
+    // cl.exe writes the include notes to stderr when the output goes to stdout
+    out.includes = gnu_toolchain(conf) ? read_depfile(obj_file + ".d") : extract_show_includes(std_err);
+    std_err.clear();
+    out.done = true;
+    return 0;
+}
+
+// run a compile where there is room: locally, or on a worker if the target can use them.
+// `pre` is the source already run through remote_preprocess_cmd, if the caller needed that anyway.
+// `rec` gets the time and peak memory of the compile, its last peak decides when a local compile can start.
+int run_compile(const project_config& conf, const target_config& targ, const std::string& src, const command_args& compile_cmd,
+                const std::string& obj_file, preprocessed_source& pre, std::string& std_out, std::string& std_err,
+                std::vector<std::string>& includes, tu_record& rec) {
+    int slot = -1;
+    if (conf.remote_workers.size()) slot = compile_slots.acquire(can_compile_remotely(conf, targ));
+
+    if (slot >= 0) {
+        uint64 start_us = trace_now_us();
+        if (!pre.done) {
+            int res = preprocess_for_remote(conf, src, compile_cmd, obj_file, rec, pre, std_err);
+            if (res) {
+                compile_slots.release(slot, true);
+                std_out += pre.text;
+                return res;
+            }
+        }
+
+        bool worker_ok;
+        int res = remote_compile(conf, src, compile_cmd, compile_slots.workers[slot].addr, obj_file, pre, std_out, std_err, worker_ok);
+        compile_slots.release(slot, worker_ok);
+        if (worker_ok) {
+            remote_compiles++;
+            includes = pre.includes;
+            rec.compile_ms = (uint32_t)((trace_now_us() - start_us) / 1000);
+            return res;
+        }
+
+        remote_fallbacks++;
+        slot = compile_slots.acquire(false);
+    }
+
+    // timed from when the memory budget and the jobserver let it run
+    uint64 reserved_kb = memory_slots.estimate(rec.peak_rss_kb);
+    memory_slots.acquire(reserved_kb);
+    job_token token;
+    jobserver_acquire(token);
+    uint64 start_us = trace_now_us();
+    uint64 peak_kb = 0;
+    int res = run_command(compile_cmd, std_out, std_err, peak_kb);
+    uint64 end_us = trace_now_us();
+    jobserver_release(token);
+    memory_slots.release(reserved_kb);
+    if (conf.remote_workers.size()) compile_slots.release(slot, true);
+
+    if (peak_kb) {
+        rec.peak_rss_kb = (uint32_t)(std::min)(peak_kb, (uint64)0xffffffff);
+        memory_slots.saw_peak(peak_kb);
+    }
+    rec.compile_ms = (uint32_t)((end_us - start_us) / 1000);
+    trace_record("compile", src, start_us, end_us, trace_thread_slot(), res);
+    includes = compile_includes(conf, obj_file, std_out);
+    return res;
+}
+
+/* bring the object file of a single source up to date.
+* if neither the source, any header it included last time, nor its compile command changed,
+* nothing runs at all. otherwise preprocess + hash it, and recompile if the preprocessed
+* output (or the command) changed. `obj_changed` is set if a new object was produced.
+* `pch_hash` is the hash of the target's .pch contents (0 without one). objects built against
+* a different .pch can't be reused, so it counts as part of the command.
+* runs on a job_pool thread: all output goes into `log` instead of stdout.
+*/
+int compile_file_incremental(const project_config& conf, const target_config& targ, hash_table& file_hashes, const std::string& src, uint64 pch_hash, bool verbose, std::string& log, bool& obj_changed) {
+    if (verbose)
+    log += format_str("       - %s...", src.c_str());
+
+    tu_record rec;
+    bool have_record = file_hashes.find(src, rec);
+    std::string obj_file = compile_output_file(conf, targ, src);
+    bool is_pch = targ.pch_header.size() && src == pch_source_file(conf, targ);
+    bool have_obj = file_exists(obj_file) && (!is_pch || file_exists(pch_file(conf, targ)));
+
+    // cached objects would have to match the exact .pch they were built against, so targets with one skip the cache.
+    // so do split-dwarf objects: their debug info is in a .dwo the cache doesn't keep
+    bool split_dwarf = gnu_toolchain(conf) && conf.split_debug_info && conf.generate_debug_info;
+    // and objects optimized with a profile, the cache key doesn't cover the profile
+    bool use_cache = conf.object_cache_dir.size() > 0 && targ.pch_header.empty() && !split_dwarf && conf.pgo != pgo_use;
+
+    // a flag change (opt_level, defines, ...) means the old object can't be reused, whatever the inputs
+    command_args compile_cmd = generate_compile_cmd(conf, targ, src);
+    uint64 cmd_hash = hash_command(compile_cmd);
+    if (pch_hash) {
+        uint64 both[2] = { cmd_hash, pch_hash };
+        cmd_hash = hash_bytes(both, sizeof(both)).lo;
+    }
+    bool can_reuse_obj = have_record && have_obj && rec.cmd_hash == cmd_hash;
+
+    bool stamps_updated = false;
+    if (can_reuse_obj && inputs_unchanged(rec, src, stamps_updated)) {
+        if (stamps_updated) file_hashes.store(src, rec);
+
+        if (verbose)
+        log += "up to date.\n";
+        return 0;
+    }
+
+    hash128 src_hash;
+    file_stamp src_stamp;
+    if (!stat_file(src, src_stamp) || !hash_file(src, src_hash)) {
+        log += format_str("error hashing [%s]\n", src.c_str());
+        return -1;
+    }
+
+    std::string std_out, std_err;
+    int res;
+
+    // something changed. if there is an object to keep, see if the preprocessed output changed too
+    // (e.g. only a comment was edited). with nothing to compare against, just compile,
+    // unless the object cache needs the preprocessed hash to look the object up.
+    hash128 hash_info;
+    bool need_to_recompile = true;
+    preprocessed_source pre;
+
+    if ((can_reuse_obj || use_cache) && can_compile_remotely(conf, targ)) {
+        // the text a worker would compile, hashed here so it only has to be preprocessed once
+        res = preprocess_for_remote(conf, src, compile_cmd, obj_file, rec, pre, std_err);
+        if (res) {
+            log += format_str("Failed! ErrorCode: %d\n", res);
+            log += pre.text + "\n";
+            log += std_err + "\n";
+            return res;
+        }
+        hash_info = hash_bytes(pre.text.data(), pre.text.size());
+
+        need_to_recompile = !(can_reuse_obj && same_hash(rec.pre_hash, hash_info));
+    } else if (can_reuse_obj || use_cache) {
+        // if the preprocessed output is different than our stored hash -> needs to be recompiled
+        res = preprocess_and_hash(conf, targ, src, hash_info, log);
+        if (res) return res;
+
+        need_to_recompile = !(can_reuse_obj && same_hash(rec.pre_hash, hash_info));
+    }
+
+    if (!need_to_recompile) {
+        // only whitespace/comments changed: same object, but remember the new header hashes.
+        // (a header that can't be hashed anymore means the includes changed after all)
+        std::vector<std::string> includes;
+        for (const auto& d : rec.deps) includes.push_back(d.path);
+        need_to_recompile = !hash_deps(includes, rec.deps);
+    }
+
+    if (need_to_recompile) {
+        std::string cache_key;
+        std::vector<std::string> includes;
+        bool cache_hit = false;
+
+        if (use_cache) {
+            trace_scope trace("cache", src);
+            cache_key = object_cache_key(conf, targ, src, hash_info);
+            cache_hit = object_cache_fetch(conf, cache_key, obj_file, includes);
+            if (cache_hit) object_cache_hits++;
+            else           object_cache_misses++;
+        }
+
+        if (cache_hit) {
+            if (verbose)
+            log += "from cache...";
+        } else {
+            if (verbose)
+            log += "recompiling...";
+
+            // the old object may be a hard link into the cache. make sure the compiler
+            // writes a new file instead of overwriting the cached one.
+            if (use_cache) delete_file(obj_file);
+
+            res = run_compile(conf, targ, src, compile_cmd, obj_file, pre, std_out, std_err, includes, rec);
+            if (res) {
+                log += format_str("Failed! ErrorCode: %d\n", res);
+                log += std_out + std_err + "\n";
+                return res;
+            }
+
+            if (use_cache) object_cache_store(conf, cache_key, obj_file, includes);
+        }
+
+        if (!hash_deps(includes, rec.deps)) {
+            log += "error hashing dependencies\n";
+            return -1;
+        }
+        obj_changed = true;
+    }
+
+    rec.pre_hash = hash_info;
+    rec.src_hash = src_hash;
+    rec.src_stamp = src_stamp;
+    rec.cmd_hash = cmd_hash;
+    file_hashes.store(src, rec);
+
+    if (verbose)
+    log += "done!\n";
+
+    return 0;
+}
+
+/* header cost report (see project_config::header_report).
+* every source is preprocessed, and the #line markers in the output rebuild its include tree
+* (msvc writes `#line 12 "file"`, gcc/clang `# 12 "file" 2`: a file already on the stack means
+* we returned to it, any other file was just included).
+* a header costs the preprocessed bytes it adds to a source, counting everything it includes.
+* estimated parse time scales that by the target's measured compile ms per preprocessed byte.
+*/
+struct header_cost {
+    uint64 includes = 0;    // times it was entered
+    uint64 tus = 0;         // sources that included it
+    uint64 self_bytes = 0;  // its own lines
+    uint64 total_bytes = 0; // its lines plus everything it included
+};
+
+struct include_tree_parser {
+    std::unordered_map<std::string, header_cost> headers;
+    std::vector<std::pair<std::string, uint64>> stack; // file, `bytes` when it was entered
+    std::string partial; // a line split across two chunks
+    uint64 bytes = 0;
+
+    void feed(const char* data, size_t len) {
+        size_t start = 0;
+        for (size_t n = 0; n < len; n++) {
+            if (data[n] != '\n') continue;
+            if (partial.size()) {
+                partial.append(data + start, n - start);
+                line(partial.data(), partial.size());
+                partial.clear();
+            } else {
+                line(data + start, n - start);
+            }
+            start = n + 1;
+        }
+        partial.append(data + start, len - start);
+    }
+
+    // the quoted file name of a line marker, or false for any other line
+    static bool parse_marker(const char* p, size_t len, std::string& file) {
+        size_t n = 0;
+        while (n < len && (p[n] == ' ' || p[n] == '\t')) n++;
+        if (n == len || p[n] != '#') return false;
+        n++;
+        while (n < len && (p[n] == ' ' || p[n] == '\t')) n++;
+        if (len - n >= 4 && memcmp(p + n, "line", 4) == 0) n += 4;
+        while (n < len && (p[n] == ' ' || p[n] == '\t')) n++;
+        if (n == len || p[n] < '0' || p[n] > '9') return false;
+        while (n < len && p[n] >= '0' && p[n] <= '9') n++;
+        while (n < len && (p[n] == ' ' || p[n] == '\t')) n++;
+        if (n == len || p[n] != '"') return false;
+
+        file.clear();
+        for (n++; n < len && p[n] != '"'; n++) {
+            if (p[n] == '\\' && n + 1 < len) n++;
+            file += p[n];
+        }
+        return true;
+    }
+
+    void leave_top() {
+        if (stack.size() > 1) headers[stack.back().first].total_bytes += bytes - stack.back().second;
+        stack.pop_back();
+    }
+
+    void line(const char* p, size_t len) {
+        std::string file;
+        if (!parse_marker(p, len, file)) {
+            bytes += len + 1;
+            // the source itself (the bottom of the stack) isn't a header
+            if (stack.size() > 1) headers[stack.back().first].self_bytes += len + 1;
+            return;
+        }
+
+        if (stack.size() && stack.back().first == file) return;
+
+        for (size_t n = stack.size(); n-- > 0; ) {
+            if (stack[n].first != file) continue;
+            while (stack.size() > n + 1) leave_top();
+            return;
+        }
+
+        stack.push_back(std::make_pair(file, bytes));
+        if (stack.size() > 1) headers[file].includes++;
+    }
+
+    void finish() {
+        if (partial.size()) line(partial.data(), partial.size());
+        partial.clear();
+        while (stack.size()) leave_top();
+    }
+};
+
+struct header_row {
+    std::string file;
+    header_cost cost;
+    double est_ms;
+};
+
+int report_header_costs(const project_config& conf) {
+    printf("Header report [%s] -> %s\n", conf.project_name.c_str(), conf.header_report.c_str());
+
+    // always stream the preprocessed output, nothing needs to be kept
+    project_config pre_conf = conf;
+    pre_conf.keep_preprocessed_files = false;
+
+    build_state state;
+    open_build_state(state, build_state_file(conf));
+
+    job_pool pool(get_job_count(conf));
+    std::mutex report_lock;
+    std::atomic<int> first_error(0);
+
+    std::string json = "{\"project\":\"" + json_escape(conf.project_name) + "\",\"targets\":[";
+    for (size_t t = 0; t < conf.targets.size(); t++) {
+        const target_config& targ = conf.targets[t];
+        hash_table table;
+        read_table(state, targ.target_name, table);
+
+        std::unordered_map<std::string, header_cost> totals;
+        uint64 target_bytes = 0;
+        uint64 timed_bytes = 0, timed_ms = 0; // sources with a compile time from an earlier build
+
+        for (const auto& src : targ.src_files) {
+            pool.submit([&, src]() {
+                include_tree_parser tree;
+                std::string std_err;
+                command_args cmd;
+                {
+                    std::string unused;
+                    cmd = generate_preprocess_cmd(pre_conf, targ, src, unused);
+                }
+                int res = run_command_streamed(cmd, [&tree](const char* data, size_t len) {
+                    tree.feed(data, len);
+                }, std_err);
+                tree.finish();
+
+                if (res) {
+                    record_error(first_error, res);
+                    print_locked(format_str("    preprocessing [%s] failed! ErrorCode: %d\n", src.c_str(), res) + std_err + "\n");
+                    return;
+                }
+
+                // gcc names a header the way it was found (`a/../inc/x.h`, `inc/x.h`), so count
+                // each one under a single spelling
+                std::unordered_map<std::string, header_cost> headers;
+                for (const auto& h : tree.headers) {
+                    // <built-in>, <command-line> and friends
+                    if (h.first.empty() || h.first[0] == '<') continue;
+
+                    header_cost& c = headers[watch_path(h.first)];
+                    c.includes    += h.second.includes;
+                    c.self_bytes  += h.second.self_bytes;
+                    c.total_bytes += h.second.total_bytes;
+                }
+
+                tu_record rec;
+                bool timed = table.find(src, rec) && rec.compile_ms > 0;
+
+                std::lock_guard<std::mutex> guard(report_lock);
+                target_bytes += tree.bytes;
+                if (timed) {
+                    timed_bytes += tree.bytes;
+                    timed_ms += rec.compile_ms;
+                }
+                for (const auto& h : headers) {
+                    header_cost& c = totals[h.first];
+                    c.includes    += h.second.includes;
+                    c.tus         += 1;
+                    c.self_bytes  += h.second.self_bytes;
+                    c.total_bytes += h.second.total_bytes;
+                }
+            });
+        }
+        pool.wait();
+
+        double ms_per_byte = timed_bytes ? (double)timed_ms / (double)timed_bytes : 0.0;
+        std::vector<header_row> rows;
+        for (const auto& h : totals) {
+            header_row row;
+            row.file = h.first;
+            row.cost = h.second;
+            row.est_ms = row.cost.total_bytes * ms_per_byte;
+            rows.push_back(row);
+        }
+        std::sort(rows.begin(), rows.end(), [](const header_row& a, const header_row& b) {
+            if (a.cost.total_bytes != b.cost.total_bytes) return a.cost.total_bytes > b.cost.total_bytes;
+            return a.file < b.file;
+        });
+
+        printf("  [%s]: %d sources, %.1f MB preprocessed", targ.target_name.c_str(), (int)targ.src_files.size(), target_bytes / (1024.0 * 1024.0));
+        if (ms_per_byte > 0) printf(", %.3f ms/KB compiled\n", ms_per_byte * 1024.0);
+        else                 printf(" (no compile times recorded yet, build once for time estimates)\n");
+        printf("      est ms   total KB    self KB   incl   TUs  header\n");
+        const size_t max_rows = 25;
+        for (size_t n = 0; n < rows.size() && n < max_rows; n++) {
+            const header_row& r = rows[n];
+            printf("  %10.1f %10.1f %10.1f %6llu %5llu  %s\n", r.est_ms, r.cost.total_bytes / 1024.0, r.cost.self_bytes / 1024.0,
+                   (unsigned long long)r.cost.includes, (unsigned long long)r.cost.tus, r.file.c_str());
+        }
+        if (rows.size() > max_rows) printf("  ... %d more in the json report\n", (int)(rows.size() - max_rows));
+
+        if (t) json += ",";
+        json += format_str("\n{\"name\":\"%s\",\"sources\":%d,\"preprocessed_bytes\":%llu,\"ms_per_byte\":%g,\"headers\":[",
+                           json_escape(targ.target_name).c_str(), (int)targ.src_files.size(), (unsigned long long)target_bytes, ms_per_byte);
+        for (size_t n = 0; n < rows.size(); n++) {
+            const header_row& r = rows[n];
+            json += format_str("%s\n  {\"file\":\"%s\",\"includes\":%llu,\"tus\":%llu,\"self_bytes\":%llu,\"total_bytes\":%llu,\"est_ms\":%.1f}",
+                               n ? "," : "", json_escape(r.file).c_str(), (unsigned long long)r.cost.includes, (unsigned long long)r.cost.tus,
+                               (unsigned long long)r.cost.self_bytes, (unsigned long long)r.cost.total_bytes, r.est_ms);
+        }
+        json += "]}";
+    }
+    json += "\n]}\n";
+    close_build_state(state);
+
+    std::ofstream out(conf.header_report, std::ios::binary | std::ios::trunc);
+    out << json;
+    if (!out) {
+        printf("    failed to write [%s]\n", conf.header_report.c_str());
+        return -1;
+    }
+    return first_error.load();
+}
+
+/* everything the incremental build sets up before it can decide anything.
+* a normal build opens one, builds once and throws it away. watch mode keeps it between builds.
+*/
+struct build_session {
+    project_config conf; // unity targets get their src_files replaced, so this is a copy
+    target_graph graph;
+    build_state state;
+    std::vector<std::unique_ptr<hash_table>> tables;
+};
+
+bool open_build_session(const project_config& project, build_session& session) {
+    session.conf = project;
+    project_config& conf = session.conf;
+
+    if (!build_target_graph(conf, session.graph)) {
+        return false;
+    }
+
+    ensure_output_dirs(conf);
+    if (!write_unity_batches(conf) || !write_pch_sources(conf)) {
+        return false;
+    }
+
+    open_build_state(session.state, build_state_file(conf));
+    session.tables.clear();
+    for (size_t n = 0; n < conf.targets.size(); n++) {
+        session.tables.emplace_back(new hash_table);
+        read_table(session.state, conf.targets[n].target_name, *session.tables[n]);
+    }
+    return true;
+}
+
+void clear_file_caches() {
+    std::lock_guard<std::mutex> guard(file_hash_lock);
+    file_hash_cache.clear();
+    file_stamp_cache.clear();
+}
+
+// compile and link everything out of date in the session, then save its tables
+int run_session_build(build_session& session) {
+    const project_config& conf = session.conf;
+    const target_graph& graph = session.graph;
+    std::vector<std::unique_ptr<hash_table>>& tables = session.tables;
+    int num_targets = conf.targets.size();
+    unsigned int num_jobs = get_job_count(conf);
+
+    bool verbose = true;
+    trace_begin(conf);
+
+    object_cache_hits = 0;
+    object_cache_misses = 0;
+    remote_compiles = 0;
+    remote_fallbacks = 0;
+    compile_slots.reset(conf);
+    memory_slots.reset(conf);
+
+    // what the hungriest action of the last build needed, so new ones aren't underestimated
+    if (session.state.header) {
+        for (uint32_t n = 0; n < session.state.header->num_tus; n++) memory_slots.saw_peak(session.state.tus[n].peak_rss_kb);
+        for (uint32_t n = 0; n < session.state.header->num_targets; n++) memory_slots.saw_peak(session.state.targets[n].link_peak_kb);
+    }
+
+    // compiles wait for a local or remote slot in run_compile, so with workers there are more threads than local jobs
+    job_pool pool(num_jobs + remote_slot_count(conf));
+    std::mutex sched_lock;
+    std::atomic<int> first_error(0);
+
+    // sources of every target are compiled right away, but a target is only
+    // linked once all of its sources are compiled and all of its dependencies are linked.
+    std::vector<int> compiles_left(num_targets);
+    std::vector<int> deps_left(num_targets);
+    for (int n = 0; n < num_targets; n++) {
+        compiles_left[n] = conf.targets[n].src_files.size();
+        deps_left[n] = graph.deps[n].size();
+    }
+
+    // must be called with sched_lock held
+    std::function<void(int)> try_link = [&](int n) {
+        if (compiles_left[n] || deps_left[n]) return;
+
+        pool.submit([&, n]() {
+            if (first_error.load()) return;
+
+            const target_config& targ = conf.targets[n];
+            command_args cmd = generate_link_cmd(conf, targ);
+            uint64 link_hash = hash_command(cmd);
+
+            // relink if the link command changed, the output is gone, or an object or lib it reads
+            // has different contents. a dependency that relinked to an identical .lib doesn't count.
+            std::vector<std::string> inputs = link_input_files(conf, targ);
+            bool stamps_updated = false;
+            bool need_link = link_hash != tables[n]->link_hash ||
+                             !file_exists(target_output_file(conf, targ)) ||
+                             !link_inputs_unchanged(tables[n]->link_inputs, inputs, stamps_updated);
+
+            // what dependents link against. if a relink leaves its interface alone, they won't relink
+            std::string interface_file = target_interface_file(conf, targ);
+            hash128 old_interface, new_interface;
+            bool had_interface = need_link && targ.type == shared_lib && hash_link_input(interface_file, old_interface);
+            const char* status = need_link ? "Done." : "up to date.";
+
+            if (need_link) {
+                uint64 reserved_kb = memory_slots.estimate(tables[n]->link_peak_kb);
+                memory_slots.acquire(reserved_kb);
+                job_token token;
+                jobserver_acquire(token);
+                trace_scope trace("link", targ.target_name);
+
+                // ar only adds to an archive, so start from an empty one
+                if (gnu_toolchain(conf) && targ.type == static_lib) delete_file(target_output_file(conf, targ));
+
+                std::string std_out, std_err;
+                uint64 peak_kb = 0;
+                int res = run_command(cmd, std_out, std_err, peak_kb);
+                jobserver_release(token);
+                memory_slots.release(reserved_kb);
+                trace.exit_code = res;
+                if (peak_kb) {
+                    tables[n]->link_peak_kb = (uint32_t)(std::min)(peak_kb, (uint64)0xffffffff);
+                    memory_slots.saw_peak(peak_kb);
+                }
 
-        while (!fid.eof()) {
-            std::getline(fid, line, ',');
-            if (line.size() == 0) break;
+                if (res) {
+                    record_error(first_error, res);
+                    print_locked(format_str("    Linking [%s]...Failed! ErrorCode: %d\n", targ.target_name.c_str(), res) +
+                                 std_out + std_err + "\n");
+                    return;
+                }
 
-            std::string filename = line;
+                // an input that can't be hashed now forces a relink next time
+                tables[n]->link_hash = hash_deps(inputs, tables[n]->link_inputs, hash_link_input) ? link_hash : 0;
 
-            MSIFILEHASHINFO entry;
-            entry.dwFileHashInfoSize = sizeof(MSIFILEHASHINFO);
+                if (had_interface && hash_link_input(interface_file, new_interface) && same_hash(old_interface, new_interface)) {
+                    status = "Done (interface unchanged).";
+                }
+            }
 
-            std::getline(fid, line, ','); entry.dwData[0] = (DWORD)std::atoll(line.c_str());
-            std::getline(fid, line, ','); entry.dwData[1] = (DWORD)std::atoll(line.c_str());
-            std::getline(fid, line, ','); entry.dwData[2] = (DWORD)std::atoll(line.c_str());
-            std::getline(fid, line);      entry.dwData[3] = (DWORD)std::atoll(line.c_str());
+            print_locked(format_str("    Linking [%s]...%s\n", targ.target_name.c_str(), status));
 
-            file_hashes[filename] = entry;
+            std::lock_guard<std::mutex> guard(sched_lock);
+            for (int d : graph.dependents[n]) {
+                deps_left[d]--;
+                try_link(d);
+            }
+        });
+    };
+
+    // targets with a precompiled header build it first. their sources start once it is done,
+    // and pch_hashes[n] holds a hash of the .pch they are compiled against.
+    std::vector<uint64> pch_hashes(num_targets, 0);
+    std::vector<uint32_t> pch_ms(num_targets, 0);
+    std::vector<int> pch_uses(num_targets, 0);
+
+    // must be called with sched_lock held
+    std::function<void(int)> start_compiles = [&](int n) {
+        for (const auto& src : conf.targets[n].src_files) {
+            pool.submit([&, n, src]() {
+                if (first_error.load()) return;
+
+                const target_config& targ = conf.targets[n];
+                std::string log;
+                bool obj_changed = false;
+                int res = compile_file_incremental(conf, targ, *tables[n], src, pch_hashes[n], verbose, log, obj_changed);
+                if (res) record_error(first_error, res);
+                print_locked(log);
+                if (res) return;
+
+                std::lock_guard<std::mutex> guard(sched_lock);
+                if (obj_changed && pch_hashes[n]) pch_uses[n]++;
+                if (--compiles_left[n] == 0) {
+                    print_locked(format_str("    Compiling [%s]...Done.\n", targ.target_name.c_str()));
+                    try_link(n);
+                }
+            });
         }
+        try_link(n);
+    };
+
+    {
+        std::lock_guard<std::mutex> guard(sched_lock);
+        for (int n : graph.order) {
+            const target_config& targ = conf.targets[n];
+            print_locked(format_str("    Compiling [%s]...%s", targ.target_name.c_str(), verbose ? "\n" : ""));
+
+            if (targ.pch_header.empty()) {
+                start_compiles(n);
+                continue;
+            }
 
-        fid.close();
+            compiles_left[n]++;
+            pool.submit([&, n]() {
+                if (first_error.load()) return;
+
+                const target_config& targ = conf.targets[n];
+                std::string pch_src = pch_source_file(conf, targ);
+                std::string log;
+                bool obj_changed = false;
+                hash128 pch_contents;
+                int res = compile_file_incremental(conf, targ, *tables[n], pch_src, 0, verbose, log, obj_changed);
+                if (res == 0 && !hash_file_contents(pch_file(conf, targ), pch_contents)) {
+                    log += format_str("error hashing [%s]\n", pch_file(conf, targ).c_str());
+                    res = -1;
+                }
+                if (res) record_error(first_error, res);
+                print_locked(log);
+                if (res) return;
+
+                tu_record rec;
+                tables[n]->find(pch_src, rec);
+
+                std::lock_guard<std::mutex> guard(sched_lock);
+                pch_hashes[n] = pch_contents.lo | 1; // never 0, that means "no pch"
+                pch_ms[n] = rec.compile_ms;
+                compiles_left[n]--;
+                start_compiles(n);
+            });
+        }
     }
-}
+    pool.wait();
 
-int build_project_incremental(const project_config& conf) {
-    int num_targets = conf.targets.size();
-    printf("Incremental Build [%s]: %d targets.\n", conf.project_name.c_str(), num_targets);
+    // save everything that finished, even if the build failed part way.
+    // records are only stored after a successful compile/link, so nothing stale gets kept.
+    if (!save_build_state(conf, session.state, tables)) {
+        printf("    failed to write [%s]\n", build_state_file(conf).c_str());
+    }
 
-    ensure_output_dirs(conf);
+    if (conf.object_cache_dir.size()) {
+        int hits = object_cache_hits.load();
+        int lookups = hits + object_cache_misses.load();
+        printf("    Object cache: %d hits, %d misses (%.1f%%)\n", hits, lookups - hits, lookups ? 100.0 * hits / lookups : 0.0);
+        trim_object_cache(conf);
+    }
 
-    bool verbose = true;
+    if (conf.memory_budget_mb) {
+        printf("    Memory: %d actions waited for the %u MB budget\n", memory_slots.waits.load(), conf.memory_budget_mb);
+    }
+    if (conf.remote_workers.size()) {
+        printf("    Remote: %d compiles on %d workers, %d fell back to local\n", remote_compiles.load(), (int)conf.remote_workers.size(), remote_fallbacks.load());
+    }
 
+    // every compile that used a precompiled header skipped parsing it,
+    // which takes about as long as creating the pch did
+    int pch_compiles = 0;
+    double pch_saved_ms = 0;
     for (int n = 0; n < num_targets; n++) {
-        const target_config& targ = conf.targets[n];
+        pch_compiles += pch_uses[n];
+        pch_saved_ms += (double)pch_uses[n] * pch_ms[n];
+    }
+    if (pch_compiles) {
+        printf("    Precompiled headers: used by %d compiles, ~%.1fs of header parsing saved\n", pch_compiles, pch_saved_ms / 1000.0);
+    }
 
-        read_table(conf, targ.target_name);
+    trace_end(conf);
 
-        printf("    Compiling [%s]...", targ.target_name.c_str());
-        if (verbose)
-        printf("\n");
-        for (const auto& src : targ.src_files) {
-            if (verbose)
-            printf("       - %s...", src.c_str());
-            std::string pre_file;
-            std::string cmd = generate_preprocess_cmd(conf, targ, src, pre_file);
+    if (first_error.load() == 0) printf("\n");
+    return first_error.load();
+}
 
-            std::string std_out, std_err;
-            int res = run_command(cmd, std_out, std_err);
+int watch_project(const project_config& project);
+int build_project_pgo(const project_config& project);
+bool read_dir(const std::string& dir, std::vector<dir_entry>& entries);
 
-            if (res) {
-                printf("Failed! ErrorCode: %d\n", res);
-                printf("%s\n", std_out.c_str());
-                printf("%s\n", std_err.c_str());
-                return res;
-            }
+int build_project_incremental(const project_config& project) {
+    jobserver_init(project);
+    if (project.watch && project.header_report.empty()) {
+        return watch_project(project);
+    }
+    if (project.pgo_train.size() && project.pgo == pgo_off && project.header_report.empty()) {
+        return build_project_pgo(project);
+    }
 
-            // hash the preprocessed file. if its different than our stored hash -> needs to be recompiled
-            MSIFILEHASHINFO hash_info;
-            hash_info.dwFileHashInfoSize = sizeof(MSIFILEHASHINFO);
-            UINT ret = MsiGetFileHashA(
-                pre_file.c_str(),
-                0,
-                &hash_info
-            );
+    printf("Incremental Build [%s]: %d targets, %u jobs%s.\n", project.project_name.c_str(), (int)project.targets.size(), get_job_count(project),
+           jobserver.active && !jobserver.serving ? " (sharing make's jobserver)" : "");
 
-            //printf("hash: [%s]: %u|%u|%u|%u\n", src.c_str(), hash_info.dwData[0],hash_info.dwData[1],hash_info.dwData[2],hash_info.dwData[3]);
-            if (ERROR_SUCCESS != ret) {
-                printf("error hashing [%s]\n", pre_file.c_str());
-                return -1;
-            }
+    build_session session;
+    if (!open_build_session(project, session)) {
+        return -1;
+    }
 
-            
-            bool need_to_recompile = true;
-            if (file_hashes.find(src) != file_hashes.end()) {
-                MSIFILEHASHINFO existing_hash = file_hashes[src];
+    if (session.conf.header_report.size()) {
+        close_build_state(session.state);
+        return report_header_costs(session.conf);
+    }
 
-                need_to_recompile = false;
-                if (existing_hash.dwData[0] != hash_info.dwData[0] ||
-                    existing_hash.dwData[1] != hash_info.dwData[1] ||
-                    existing_hash.dwData[2] != hash_info.dwData[2] ||
-                    existing_hash.dwData[3] != hash_info.dwData[3]) {
+    clear_file_caches();
+    return run_session_build(session);
+}
 
-                    need_to_recompile = true;
-                }
-            }
+/* profile guided optimization (see project_config::pgo_train), in three stages:
+*   1. build instrumented binaries, into <pgo_dir>/bin with objects in <pgo_dir>/obj
+*   2. run pgo_train against them, and turn the profiles it wrote into one (llvm-profdata merge for clang)
+*   3. build the real outputs with the profile
+* both builds are normal incremental builds with their own state file. objects built with the
+* profile depend on <pgo_dir>/profile.id, a hash of the profile, so they are only recompiled
+* when training actually produced a different profile.
+*/
 
-            file_hashes[src] = hash_info;
+// "clang++-17" -> "llvm-profdata-17", so the llvm tools match the compiler's version
+std::string llvm_tool(const project_config& conf, const std::string& tool) {
+    std::string cc = compiler_program(conf);
+    size_t dash = cc.find_last_of('-');
+    if (dash != std::string::npos && dash + 1 < cc.size() && cc.find_first_not_of("0123456789.", dash + 1) == std::string::npos) {
+        return tool + cc.substr(dash);
+    }
+    return tool;
+}
 
-            // if we need to recompile, do that
-            if (need_to_recompile) {
-                if (verbose)
-                printf("recompiling...");
+// the profiles the instrumented binaries write
+std::vector<std::string> list_raw_profiles(const project_config& conf) {
+    std::string ext = conf.toolchain == toolchain_clang ? ".profraw" : (gnu_toolchain(conf) ? ".gcda" : ".pgc");
+    std::string raw_dir = pgo_raw_dir(conf);
 
-                cmd = generate_compile_cmd(conf, targ, src);
-                res = run_command(cmd, std_out, std_err);
+    std::vector<dir_entry> entries;
+    read_dir(raw_dir, entries);
 
-                if (res) {
-                    printf("Failed! ErrorCode: %d\n", res);
-                    printf("%s\n", std_out.c_str());
-                    return res;
-                }
-            }
-            if (verbose)
-            printf("done!\n");
+    std::vector<std::string> files;
+    for (const auto& e : entries) {
+        if (!e.is_dir && e.name.size() > ext.size() && e.name.compare(e.name.size() - ext.size(), ext.size(), ext) == 0) {
+            files.push_back(raw_dir + path_sep + e.name);
         }
-        if (verbose)
-        printf("    Compiling [%s]...", targ.target_name.c_str());
-        printf("Done.\n");
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+int run_pgo_training(const project_config& conf) {
+    // profiles left from the last training would be added to this one
+    for (const auto& f : list_raw_profiles(conf)) delete_file(f);
+
+    command_args cmd;
+    for (auto a : conf.pgo_train) {
+        for (size_t at = a.find("{bin_dir}"); at != std::string::npos; at = a.find("{bin_dir}", at + conf.bin_dir.size())) {
+            a.replace(at, 9, conf.bin_dir);
+        }
+        cmd.push_back(a);
+    }
+
+    // one file per process, they are merged below
+    if (conf.toolchain == toolchain_clang) {
+        set_env("LLVM_PROFILE_FILE", absolute_path(pgo_raw_dir(conf)) + path_sep + "%p.profraw");
+    }
+
+    printf("    Training [%s]...\n", command_line_string(cmd).c_str());
+    std::string std_err;
+    int res = run_command_streamed(cmd, [](const char* data, size_t len) { fwrite(data, 1, len, stdout); }, std_err);
+    printf("%s", std_err.c_str());
+    if (res) {
+        printf("    Training...Failed! ErrorCode: %d\n", res);
+        return res;
+    }
 
-        printf("    Linking [%s]...", targ.target_name.c_str());
-        std::string cmd = generate_link_cmd(conf, targ);
+    std::vector<std::string> profiles = list_raw_profiles(conf);
+    if (profiles.empty()) {
+        printf("    Training...Failed! Nothing was written to [%s]\n", pgo_raw_dir(conf).c_str());
+        return -1;
+    }
 
-        std::string std_out, std_err;
-        int res = run_command(cmd, std_out, std_err);
+    // the id is a hash of what the optimized build reads: clang's merged profile, or all of gcc's / msvc's
+    std::vector<hash128> hashes;
+    if (conf.toolchain == toolchain_clang) {
+        command_args merge = {llvm_tool(conf, "llvm-profdata"), "merge", "-output=" + pgo_merged_file(conf)};
+        merge.insert(merge.end(), profiles.begin(), profiles.end());
 
+        std::string std_out;
+        res = run_command(merge, std_out, std_err);
         if (res) {
-            printf("Failed! ErrorCode: %d\n", res);
-            printf("%s\n", std_out.c_str());
+            printf("    Merging profiles...Failed! ErrorCode: %d\n%s%s\n", res, std_out.c_str(), std_err.c_str());
             return res;
         }
+        profiles = { pgo_merged_file(conf) };
+    }
+    for (const auto& f : profiles) {
+        hash128 h;
+        if (!hash_file_contents(f, h)) {
+            printf("    error hashing [%s]\n", f.c_str());
+            return -1;
+        }
+        hashes.push_back(h);
+    }
+    // gcc's are one file per object, whose names don't matter
+    std::sort(hashes.begin(), hashes.end(), [](const hash128& a, const hash128& b) { return a.hi != b.hi ? a.hi < b.hi : a.lo < b.lo; });
+    hash128 id = hash_bytes(hashes.data(), hashes.size() * sizeof(hash128));
 
-        printf("Done.\n\n");
-
-        // save the hash-table to a file, so it can be reloaded and checked
-        write_table(conf, targ.target_name);
+    if (!write_if_changed(pgo_profile_id_file(conf), format_str("%016llx%016llx\n", (unsigned long long)id.hi, (unsigned long long)id.lo))) {
+        printf("    Error: could not write [%s]\n", pgo_profile_id_file(conf).c_str());
+        return -1;
     }
 
+    printf("    Training...Done (%d profiles).\n", (int)list_raw_profiles(conf).size());
     return 0;
 }
 
-char space_buf[] = "                                                                      ";
-bool get_all_files_in_dir(std::vector<std::string>& files, const std::string& dir, const std::vector<std::string>& ext_types, int level) {
-    std::string search = dir + "\\*";
-    WIN32_FIND_DATA data;
-    HANDLE hFind = FindFirstFile(search.c_str(), &data);  // finds .
-    FindNextFile(hFind, &data); // finds ..
+int build_project_pgo(const project_config& project) {
+    printf("PGO Build [%s]: instrumented build, training, optimized build.\n", project.project_name.c_str());
+
+    // both stages share the profile dir, so fix it before obj_dir changes
+    project_config instr = project;
+    instr.pgo_dir = pgo_root(project);
+    instr.pgo = pgo_generate;
+    instr.bin_dir = instr.pgo_dir + path_sep + "bin";
+    instr.obj_dir = instr.pgo_dir + path_sep + "obj";
+    // the instrumented binaries only have to run, not be fast. the trace is of the optimized build
+    instr.lto = lto_none;
+    instr.trace_file = "";
+
+    int res = build_project_incremental(instr);
+    if (res) return res;
+
+    res = run_pgo_training(instr);
+    if (res) return res;
+
+    project_config opt = project;
+    opt.pgo_dir = instr.pgo_dir;
+    opt.pgo = pgo_use;
+    return build_project_incremental(opt);
+}
+
+/* watch mode (see project_config::watch).
+* the session (target graph, tables) and the stat/hash caches stay in memory between builds.
+* the directories of every file the last build read are watched (inotify, ReadDirectoryChangesW,
+* stat polling elsewhere), and a change only drops the cache entries of the files that changed. so the next build
+* stats and hashes nothing else, and only runs the compiler for sources that include a changed file.
+*/
+
+bool path_under_dir(const std::string& path, const std::string& dir) {
+    return path.size() > dir.size() && path.compare(0, dir.size(), dir) == 0 &&
+           (path[dir.size()] == '\\' || path[dir.size()] == '/');
+}
+
+std::string parent_dir(const std::string& path) {
+    size_t last_slash = path.find_last_of("\\/");
+    return last_slash == std::string::npos ? "." : path.substr(0, last_slash);
+}
 
-    while (FindNextFile(hFind, &data)) {
-        if (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) {
-            //printf("%.*sDir:  [%s]\n", 2*level, space_buf, data.cFileName);
+struct file_watcher {
+#ifdef _WIN32
+    struct watched_dir {
+        std::string path;
+        HANDLE handle = INVALID_HANDLE_VALUE;
+        OVERLAPPED overlapped;
+        DWORD buffer[16 * 1024]; // ReadDirectoryChangesW wants it DWORD aligned
+    };
+    HANDLE port = NULL;
+    std::vector<std::unique_ptr<watched_dir>> dirs;
+#elif defined(__linux__)
+    int fd = -1;
+    std::unordered_map<int, std::string> dirs; // watch descriptor -> dir
+#endif
+    std::unordered_set<std::string> watching;
+
+#ifdef _WIN32
+    static bool start_read(watched_dir& d) {
+        memset(&d.overlapped, 0, sizeof(d.overlapped));
+        return ReadDirectoryChangesW(d.handle, d.buffer, sizeof(d.buffer), FALSE,
+                                     FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_SIZE,
+                                     NULL, &d.overlapped, NULL) != 0;
+    }
+
+    // `dir` as given by watch_path
+    bool add_dir(const std::string& dir) {
+        if (!watching.insert(dir).second) return true;
+        if (!port) port = CreateIoCompletionPort(INVALID_HANDLE_VALUE, NULL, 0, 0);
+        if (!port) return false;
+
+        std::unique_ptr<watched_dir> d(new watched_dir);
+        d->path = dir;
+        d->handle = CreateFileA(dir.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+        if (d->handle == INVALID_HANDLE_VALUE) return false;
+        if (!CreateIoCompletionPort(d->handle, port, (ULONG_PTR)dirs.size(), 0) || !start_read(*d)) {
+            CloseHandle(d->handle);
+            return false;
+        }
+        dirs.push_back(std::move(d));
+        return true;
+    }
 
-            std::string new_dir = dir + "\\" + std::string(data.cFileName);
-            get_all_files_in_dir(files, new_dir, ext_types, level + 1);
+    /* waits up to timeout_ms (-1: forever) for changes and appends their watch_path()s.
+    * `overflow` is set when changes were lost and everything has to be assumed changed.
+    * false if nothing happened before the timeout.
+    */
+    bool wait(int timeout_ms, std::vector<std::string>& changed, bool& overflow) {
+        if (!port) return false;
+
+        DWORD bytes = 0;
+        ULONG_PTR key = 0;
+        OVERLAPPED* ov = NULL;
+        BOOL ok = GetQueuedCompletionStatus(port, &bytes, &key, &ov, timeout_ms < 0 ? INFINITE : (DWORD)timeout_ms);
+        if (!ov) return false;
+
+        watched_dir& d = *dirs[key];
+        if (!ok) {
+            // the dir itself went away
+            overflow = true;
+            return true;
+        }
+
+        if (bytes == 0) {
+            // more changes than fit in the buffer
+            overflow = true;
         } else {
-            std::string filename(data.cFileName);
+            const char* p = (const char*)d.buffer;
+            for (;;) {
+                const FILE_NOTIFY_INFORMATION* info = (const FILE_NOTIFY_INFORMATION*)p;
+                char name[MAX_PATH * 3];
+                int len = WideCharToMultiByte(CP_UTF8, 0, info->FileName, (int)(info->FileNameLength / sizeof(WCHAR)),
+                                              name, sizeof(name), NULL, NULL);
+                if (len > 0) changed.push_back(watch_path(d.path + "\\" + std::string(name, len)));
+                if (!info->NextEntryOffset) break;
+                p += info->NextEntryOffset;
+            }
+        }
+
+        if (!start_read(d)) overflow = true;
+        return true;
+    }
+
+    ~file_watcher() {
+        for (auto& d : dirs) {
+            CancelIo(d->handle);
+            CloseHandle(d->handle);
+        }
+        if (port) CloseHandle(port);
+    }
+#elif defined(__linux__)
+    bool add_dir(const std::string& dir) {
+        if (!watching.insert(dir).second) return true;
+        if (fd < 0) fd = inotify_init1(IN_CLOEXEC | IN_NONBLOCK);
+        if (fd < 0) return false;
+
+        int wd = inotify_add_watch(fd, dir.c_str(), IN_CLOSE_WRITE | IN_MODIFY | IN_ATTRIB | IN_CREATE |
+                                                    IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO);
+        if (wd < 0) return false;
+        dirs[wd] = dir;
+        return true;
+    }
+
+    bool wait(int timeout_ms, std::vector<std::string>& changed, bool& overflow) {
+        if (fd < 0) return false;
+
+        pollfd p = {fd, POLLIN, 0};
+        if (poll(&p, 1, timeout_ms) <= 0) return false;
+
+        alignas(inotify_event) char buf[64 * 1024];
+        ssize_t len;
+        while ((len = read(fd, buf, sizeof(buf))) > 0) {
+            for (char* at = buf; at < buf + len; ) {
+                const inotify_event* e = (const inotify_event*)at;
+                if (e->mask & IN_Q_OVERFLOW) {
+                    overflow = true;
+                } else if (e->len) {
+                    auto it = dirs.find(e->wd);
+                    if (it != dirs.end()) changed.push_back(it->second + "/" + e->name);
+                }
+                at += sizeof(inotify_event) + e->len;
+            }
+        }
+        return true;
+    }
+
+    ~file_watcher() {
+        if (fd >= 0) close(fd);
+    }
+#else
+    /* no inotify here (macOS, the BSDs): every watched dir is listed and its files stat'ed again
+    * every poll_ms, and whatever was added, removed or got a different stamp counts as changed.
+    */
+    static const int poll_ms = 250;
+    std::unordered_map<std::string, std::unordered_map<std::string, file_stamp>> dirs; // dir -> file -> stamp
+
+    static bool list_dir(const std::string& dir, std::unordered_map<std::string, file_stamp>& files) {
+        DIR* d = opendir(dir.c_str());
+        if (!d) return false;
+        while (dirent* e = readdir(d)) {
+            if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+            std::string path = dir + "/" + e->d_name;
+            file_stamp stamp;
+            if (read_file_stamp(path, stamp)) files[path] = stamp;
+        }
+        closedir(d);
+        return true;
+    }
+
+    bool add_dir(const std::string& dir) {
+        if (!watching.insert(dir).second) return true;
+        return list_dir(dir, dirs[dir]);
+    }
 
-            bool valid_ending = false;
-            for (const auto& ending : ext_types) {
-                if (std::equal(ending.rbegin(), ending.rend(), filename.rbegin())) {
-                    valid_ending = true;
-                    break;
+    bool rescan(std::vector<std::string>& changed) {
+        bool found = false;
+        for (auto& d : dirs) {
+            std::unordered_map<std::string, file_stamp> now;
+            list_dir(d.first, now);
+            for (const auto& f : now) {
+                auto it = d.second.find(f.first);
+                if (it == d.second.end() || !same_stamp(it->second, f.second)) {
+                    changed.push_back(f.first);
+                    found = true;
+                }
+            }
+            for (const auto& f : d.second) {
+                if (!now.count(f.first)) {
+                    changed.push_back(f.first);
+                    found = true;
                 }
             }
-            if (valid_ending) {
-                std::string full_filename = dir + "\\" + filename;
-                //printf("%.*sFile: [%s] {%u}\n", 2 * level, space_buf, full_filename.c_str(), data.dwFileAttributes);
+            d.second.swap(now);
+        }
+        return found;
+    }
+
+    bool wait(int timeout_ms, std::vector<std::string>& changed, bool& overflow) {
+        if (dirs.empty()) return false;
+        (void)overflow; // a rescan never misses anything
+
+        int waited = 0;
+        for (;;) {
+            if (rescan(changed)) return true;
+            if (timeout_ms >= 0 && waited >= timeout_ms) return false;
+            int sleep_ms = poll_ms;
+            if (timeout_ms >= 0 && timeout_ms - waited < sleep_ms) sleep_ms = timeout_ms - waited;
+            std::this_thread::sleep_for(std::chrono::milliseconds(sleep_ms));
+            waited += sleep_ms;
+        }
+    }
+#endif
+};
+
+int watch_project(const project_config& project) {
+    printf("Watching [%s]: %d targets, %u jobs.\n", project.project_name.c_str(), (int)project.targets.size(), get_job_count(project));
+
+    build_session session;
+    if (!open_build_session(project, session)) {
+        return -1;
+    }
+    const project_config& conf = session.conf;
+
+    // everything stays in memory from here on, the state file is only written
+    for (auto& t : session.tables) t->load_all();
+    close_build_state(session.state);
+
+    clear_file_caches();
+    int res = run_session_build(session);
+
+    // files the build writes itself. their events are ignored, and what we cached about them is
+    // dropped before every build, since the previous build may have rewritten them
+    std::vector<std::string> output_dirs = { watch_path(conf.bin_dir), watch_path(conf.obj_dir) };
+    auto is_output = [&](const std::string& path) {
+        for (const auto& dir : output_dirs) {
+            if (path == dir || path_under_dir(path, dir)) return true;
+        }
+        return false;
+    };
+
+    std::unordered_map<std::string, std::string> normalized; // memoized watch_path()
+    auto normalize = [&](const std::string& path) -> const std::string& {
+        auto it = normalized.find(path);
+        if (it != normalized.end()) return it->second;
+        return normalized[path] = watch_path(path);
+    };
+
+    // src_files come from the build-script's run, so a source added to or removed from one of their
+    // dirs can't be picked up here. spot those to tell the user to restart
+    std::unordered_set<std::string> sources, source_dirs, source_exts;
+    auto extension = [](const std::string& path) {
+        size_t last_dot = path.find_last_of('.');
+        size_t last_slash = path.find_last_of("\\/");
+        if (last_dot == std::string::npos || (last_slash != std::string::npos && last_dot < last_slash)) return std::string();
+        return path.substr(last_dot);
+    };
+    for (const auto& targ : project.targets) {
+        for (const auto& src : targ.src_files) {
+            const std::string& path = normalize(src);
+            sources.insert(path);
+            source_dirs.insert(parent_dir(path));
+            source_exts.insert(extension(path));
+        }
+    }
+    auto source_added_or_removed = [&](const std::string& path) {
+        if (sources.count(path)) return !file_exists(path);
+        return source_dirs.count(parent_dir(path)) && source_exts.count(extension(path)) && file_exists(path);
+    };
+
+    file_watcher watcher;
+    std::unordered_set<std::string> tracked;
+    for (;;) {
+        // the files the last build read, and the dirs they are in. sources that failed to compile
+        // have no headers recorded yet, so their include_dirs are watched as well
+        tracked.clear();
+        std::unordered_set<std::string> dirs;
+        for (size_t n = 0; n < conf.targets.size(); n++) {
+            const target_config& targ = conf.targets[n];
+            hash_table& table = *session.tables[n];
+            for (const auto& src : targ.src_files) tracked.insert(normalize(src));
+            for (const auto& e : table.entries) {
+                tracked.insert(normalize(e.first));
+                for (const auto& d : e.second.deps) tracked.insert(normalize(d.path));
+            }
+            for (const auto& d : table.link_inputs) tracked.insert(normalize(d.path));
+            for (const auto& inc : targ.include_dirs) dirs.insert(normalize(inc));
+        }
+        for (const auto& path : tracked) dirs.insert(parent_dir(path));
+        int num_dirs = 0;
+        for (const auto& dir : dirs) {
+            if (is_output(dir)) continue;
+            if (!watcher.add_dir(dir)) {
+                printf("    can't watch [%s]\n", dir.c_str());
+                return -1;
+            }
+            num_dirs++;
+        }
+        printf("Watching %d dirs for changes (Ctrl+C to stop)...\n", num_dirs);
+
+        // block until something changes, then keep collecting until it has been quiet for a bit
+        std::vector<std::string> changed;
+        bool overflow = false;
+        bool relevant = false;
+        while (!relevant) {
+            changed.clear();
+            overflow = false;
+            watcher.wait(-1, changed, overflow);
+            while (watcher.wait((int)conf.watch_debounce_ms, changed, overflow)) {}
+
+            changed.erase(std::remove_if(changed.begin(), changed.end(), is_output), changed.end());
+            std::sort(changed.begin(), changed.end());
+            changed.erase(std::unique(changed.begin(), changed.end()), changed.end());
+
+            for (const auto& path : changed) {
+                if (!source_added_or_removed(path)) continue;
+                printf("\nSources were added or removed ([%s]), restart watch mode to pick them up.\n", path.c_str());
+                break;
+            }
+
+            // after a failed build, any change in a watched dir could be the fix
+            relevant = overflow || (res && changed.size());
+            for (const auto& path : changed) relevant |= tracked.count(path) > 0;
+        }
+
+        {
+            std::unordered_set<std::string> changed_set(changed.begin(), changed.end());
+            auto stale = [&](const std::string& path) {
+                if (overflow) return true;
+                const std::string& p = normalize(path);
+                return changed_set.count(p) > 0 || is_output(p);
+            };
+
+            std::lock_guard<std::mutex> guard(file_hash_lock);
+            for (auto it = file_stamp_cache.begin(); it != file_stamp_cache.end(); ) {
+                if (stale(it->first)) it = file_stamp_cache.erase(it);
+                else ++it;
+            }
+            for (auto it = file_hash_cache.begin(); it != file_hash_cache.end(); ) {
+                if (stale(it->first)) it = file_hash_cache.erase(it);
+                else ++it;
+            }
+        }
 
-                files.push_back(full_filename);
+        if (overflow) printf("\nToo many changes to track, checking everything...\n");
+        else          printf("\n%d file%s changed, rebuilding...\n", (int)changed.size(), changed.size() == 1 ? "" : "s");
+        res = run_session_build(session);
+    }
+}
+
+/* source discovery.
+* globs are compiled once: "*.ext" patterns become one lookup of the file's extension in a set,
+* anything else is matched by dir (`*` and `?` stay within a dir, `**` spans any number of dirs).
+* paths are matched relative to the folder being searched, with '/' between dirs, and a pattern
+* without a '/' matches a name at any depth (so "third_party" skips every dir of that name).
+*/
+struct glob_pattern {
+    std::vector<std::string> segments;
+};
+
+struct file_filter {
+    std::unordered_set<std::string> extensions; // ".cpp", from "*.cpp"
+    std::vector<glob_pattern> globs;
+    bool empty() const { return extensions.empty() && globs.empty(); }
+};
+
+file_filter compile_filter(const std::vector<std::string>& patterns) {
+    file_filter filter;
+    for (std::string p : patterns) {
+        std::replace(p.begin(), p.end(), '\\', '/');
+        if (p.empty()) continue;
+
+        if (p.size() > 2 && p[0] == '*' && p[1] == '.' && p.find_first_of("*?/.", 2) == std::string::npos) {
+            filter.extensions.insert(p.substr(1));
+            continue;
+        }
+
+        glob_pattern g;
+        if (p.find('/') == std::string::npos) g.segments.push_back("**");
+        size_t start = 0;
+        while (start <= p.size()) {
+            size_t end = p.find('/', start);
+            if (end == std::string::npos) end = p.size();
+            if (end > start) g.segments.push_back(p.substr(start, end - start));
+            start = end + 1;
+        }
+        filter.globs.push_back(g);
+    }
+    return filter;
+}
+
+// `*` and `?` within one name
+bool match_wildcards(const char* pat, const char* str) {
+    const char* star = nullptr;
+    const char* retry = nullptr;
+    while (*str) {
+        if (*pat == '*') {
+            star = pat++;
+            retry = str;
+        } else if (*pat == '?' || *pat == *str) {
+            pat++;
+            str++;
+        } else if (star) {
+            pat = star + 1;
+            str = ++retry;
+        } else {
+            return false;
+        }
+    }
+    while (*pat == '*') pat++;
+    return *pat == 0;
+}
+
+bool match_segments(const std::vector<std::string>& pat, size_t p, const std::vector<std::string>& path, size_t s) {
+    for (; p < pat.size(); p++, s++) {
+        if (pat[p] == "**") {
+            for (size_t skip = s; skip <= path.size(); skip++) {
+                if (match_segments(pat, p + 1, path, skip)) return true;
             }
+            return false;
+        }
+        if (s == path.size() || !match_wildcards(pat[p].c_str(), path[s].c_str())) return false;
+    }
+    return s == path.size();
+}
+
+// `rel_dirs` are the dirs leading to `name`, below the searched folder
+bool filter_matches(const file_filter& filter, const std::vector<std::string>& rel_dirs, const std::string& name) {
+    if (filter.extensions.size()) {
+        size_t dot = name.find_last_of('.');
+        if (dot != std::string::npos && filter.extensions.count(name.substr(dot))) return true;
+    }
+    if (filter.globs.empty()) return false;
+
+    std::vector<std::string> path = rel_dirs;
+    path.push_back(name);
+    for (const auto& g : filter.globs) {
+        if (match_segments(g.segments, 0, path, 0)) return true;
+    }
+    return false;
+}
+
+// the last-write time of a dir, in the same units stat_file uses for files
+bool dir_mtime(const std::string& dir, uint64& mtime) {
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA info;
+    if (!GetFileAttributesExA(dir.c_str(), GetFileExInfoStandard, &info)) return false;
+    mtime = ((uint64)info.ftLastWriteTime.dwHighDateTime << 32) | info.ftLastWriteTime.dwLowDateTime;
+
+    FILETIME now_ft;
+    GetSystemTimeAsFileTime(&now_ft);
+    uint64 now = ((uint64)now_ft.dwHighDateTime << 32) | now_ft.dwLowDateTime;
+    const uint64 two_seconds = 2ull * 10000000ull; // 100ns ticks
+#else
+    struct stat st;
+    if (stat(dir.c_str(), &st) != 0) return false;
+    mtime = (uint64)st.st_mtim.tv_sec * 1000000000ull + (uint64)st.st_mtim.tv_nsec;
+
+    timespec now_ts;
+    clock_gettime(CLOCK_REALTIME, &now_ts);
+    uint64 now = (uint64)now_ts.tv_sec * 1000000000ull + (uint64)now_ts.tv_nsec;
+    const uint64 two_seconds = 2000000000ull;
+#endif
+    // an entry added right after we list the dir might not move a fresh mtime (coarse timestamps)
+    if (mtime + two_seconds > now) mtime = 0;
+    return true;
+}
+
+bool read_dir(const std::string& dir, std::vector<dir_entry>& entries) {
+#ifdef _WIN32
+    WIN32_FIND_DATAA data;
+    HANDLE find = FindFirstFileExA((dir + "\\*").c_str(), FindExInfoBasic, &data, FindExSearchNameMatch, NULL, FIND_FIRST_EX_LARGE_FETCH);
+    if (find == INVALID_HANDLE_VALUE) return false;
+    do {
+        if (strcmp(data.cFileName, ".") == 0 || strcmp(data.cFileName, "..") == 0) continue;
+        entries.push_back({ data.cFileName, (data.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) != 0 });
+    } while (FindNextFileA(find, &data));
+    FindClose(find);
+#else
+    DIR* d = opendir(dir.c_str());
+    if (!d) return false;
+    while (dirent* e = readdir(d)) {
+        if (strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        bool is_dir = e->d_type == DT_DIR;
+        if (e->d_type == DT_UNKNOWN || e->d_type == DT_LNK) {
+            // symlinked dirs aren't followed, so there are no cycles
+            struct stat st;
+            if (lstat((dir + "/" + e->d_name).c_str(), &st) != 0) continue;
+            if (S_ISLNK(st.st_mode) && stat((dir + "/" + e->d_name).c_str(), &st) == 0 && S_ISDIR(st.st_mode)) continue;
+            is_dir = S_ISDIR(st.st_mode);
+        }
+        entries.push_back({ e->d_name, is_dir });
+    }
+    closedir(d);
+#endif
+    return true;
+}
+
+// a dir's entries, from discovery_cache if the dir hasn't changed since they were read
+bool list_dir(const std::string& dir, std::vector<dir_entry>& entries) {
+    if (!discovery_cache.enabled) return read_dir(dir, entries);
+
+    uint64 mtime = 0;
+    if (!dir_mtime(dir, mtime)) return false;
+    {
+        std::lock_guard<std::mutex> guard(discovery_cache.lock);
+        auto it = discovery_cache.dirs.find(dir);
+        if (it != discovery_cache.dirs.end() && mtime && it->second.mtime == mtime) {
+            it->second.visited = true;
+            entries = it->second.entries;
+            return true;
         }
     }
 
+    if (!read_dir(dir, entries)) return false;
+
+    std::lock_guard<std::mutex> guard(discovery_cache.lock);
+    dir_listing& listing = discovery_cache.dirs[dir];
+    listing.mtime = mtime;
+    listing.entries = entries;
+    listing.visited = true;
+    return true;
+}
+
+// every file under `dir` matching `include` and not `exclude`, sorted. subtrees are walked in parallel
+std::vector<std::string> find_files(const std::string& dir, const std::vector<std::string>& include, const std::vector<std::string>& exclude = {}) {
+    file_filter inc = compile_filter(include);
+    file_filter exc = compile_filter(exclude);
+
+    std::mutex files_lock;
+    std::vector<std::string> files;
+
+    unsigned int hw = std::thread::hardware_concurrency();
+    job_pool pool(hw ? (std::min)(hw, 8u) : 1);
+
+    std::function<void(std::string, std::vector<std::string>)> walk = [&](std::string path, std::vector<std::string> rel_dirs) {
+        std::vector<dir_entry> entries;
+        if (!list_dir(path, entries)) return;
+
+        std::vector<std::string> found;
+        for (const auto& e : entries) {
+            if (!exc.empty() && filter_matches(exc, rel_dirs, e.name)) continue;
+
+            std::string full = path + path_sep + e.name;
+            if (e.is_dir) {
+                std::vector<std::string> sub = rel_dirs;
+                sub.push_back(e.name);
+                pool.submit([&walk, full, sub]() { walk(full, sub); });
+            } else if (filter_matches(inc, rel_dirs, e.name)) {
+                found.push_back(full);
+            }
+        }
+
+        std::lock_guard<std::mutex> guard(files_lock);
+        files.insert(files.end(), found.begin(), found.end());
+    };
+
+    pool.submit([&]() { walk(dir, {}); });
+    pool.wait();
+
+    std::sort(files.begin(), files.end());
+    return files;
+}
+
+bool get_all_files_in_dir(std::vector<std::string>& files, const std::string& dir, const std::vector<std::string>& ext_types) {
+    std::vector<std::string> patterns;
+    for (const auto& ext : ext_types) patterns.push_back("*" + ext);
+
+    std::vector<std::string> found = find_files(dir, patterns);
+    files.insert(files.end(), found.begin(), found.end());
     return true;
 }
 
+// the dir of the build-script that calls find_all_files/find_files, with a trailing separator
+std::string calling_dir(const char* calling_file) {
+    std::string base_dir(calling_file);
+#ifdef _WIN32
+    std::replace(base_dir.begin(), base_dir.end(), '/', '\\');
+#endif
+    auto last = base_dir.find_last_of(path_sep);
+    return base_dir.substr(0, last+1);
+}
+
+// find_files relative to the calling build-script, e.g.
+//   targ.src_files = find_files_in("src", {"*.cpp", "*.c"}, {"*_test.cpp", "third_party"});
+#define find_files_in(folder, ...) find_files(calling_dir(__FILE__) + folder, __VA_ARGS__)
+
 #define find_all_files(folder, ext_types) __find_all_files(__FILE__, folder, ext_types)
 std::vector<std::string> __find_all_files(const char* calling_file, const std::string& folder, std::string extension_list) {
     // parse the extension list into individual strings
@@ -721,7 +5859,6 @@ std::vector<std::string> __find_all_files(const char* calling_file, const std::s
     while (n2 != std::string::npos) {
         std::string ext = extension_list.substr(0, n2);
         ext_types.push_back(ext);
-        //printf("extension: [%s]\n", ext.c_str());
 
         extension_list = extension_list.substr(n2+1, extension_list.length()-n2-1);
         n2 = extension_list.find_first_of(',');
@@ -729,38 +5866,15 @@ std::vector<std::string> __find_all_files(const char* calling_file, const std::s
     std::string ext = extension_list;
     ext_types.push_back(ext);
 
-    // get the base directory from calling_file (which includes the filename)
-    // we do this by finding the last '\'
-    std::string base_dir(calling_file);
-    std::replace(base_dir.begin(), base_dir.end(), '/', '\\');
-    auto last = base_dir.find_last_of('\\');
-    base_dir = base_dir.substr(0, last+1);
-
-    //printf("base_dir: %s\n", base_dir.c_str());
     std::vector<std::string> files;
-
-    std::string search = base_dir + folder;
-    //printf("search:   %s\n", search.c_str());
-
-    get_all_files_in_dir(files, search, ext_types, 0);
-    //printf("=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=\n");
-    //for (const auto& a : files) {
-    //    printf("File: [%s]\n", a.c_str());
-    //}
-    //printf("=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=-=\n");
-
+    get_all_files_in_dir(files, calling_dir(calling_file) + folder, ext_types);
     return files;
 }
 
 #define TO_STR_VECTOR(...) std::vector < std::string > {__VA_ARGS__}
 #define relative_dirs(...) __get_relative_dirs(__FILE__, TO_STR_VECTOR(__VA_ARGS__))
 std::vector<std::string> __get_relative_dirs(const char* calling_file, std::vector<std::string> dirs) {
-    // get the base directory from calling_file (which includes the filename)
-    // we do this by finding the last '\'
-    std::string base_dir(calling_file);
-    std::replace(base_dir.begin(), base_dir.end(), '/', '\\');
-    auto last = base_dir.find_last_of('\\');
-    base_dir = base_dir.substr(0, last+1);
+    std::string base_dir = calling_dir(calling_file);
 
     std::vector<std::string> full_dirs;
     for (const auto& d : dirs) {
@@ -771,10 +5885,10 @@ std::vector<std::string> __get_relative_dirs(const char* calling_file, std::vect
     return full_dirs;
 }
 
-typedef uint64_t uint64;
 uint64 get_file_timestamp(const char* filename) {
     uint64 res = 0;
 
+#ifdef _WIN32
     WIN32_FILE_ATTRIBUTE_DATA info;
     BOOL found = GetFileAttributesExA(filename, GetFileExInfoStandard, &info);
     if (!found) {
@@ -784,35 +5898,179 @@ uint64 get_file_timestamp(const char* filename) {
     uint64 L = (uint64)info.ftLastWriteTime.dwLowDateTime;
     uint64 H = (uint64)info.ftLastWriteTime.dwHighDateTime;
     res = (H<<32) | L;
+#else
+    struct stat st;
+    if (stat(filename, &st) != 0) {
+        return uint64(-1);
+    }
+    res = (uint64)st.st_mtim.tv_sec * 1000000000ull + (uint64)st.st_mtim.tv_nsec;
+#endif
 
     return res;
 }
 
-#define auto_rebuild_self(argc, argv) _auto_rebuild_self(argc, argv, __FILE__)
-void _auto_rebuild_self(int argc, char* argv[], const char* src_filename) {
-    if (argc == 2) {
-        if (strcmp(argv[1], "rebuild") == 0) {
-            // we are now _build.exe, so we can copy ourselves to build.exe
-            // and rename the incoming one to our old name.
+/* auto_rebuild_self(): the build-script rebuilds itself when it, a sub-script it #includes or build.h changed.
+* the files it was built from are listed in <obj_dir>/_build/_build.deps, with their stamps and the
+* object cache key of that compile. on startup only those files are stat'ed. if one changed, the script
+* is preprocessed, and only recompiled if the compiler would see something different. objects go in an
+* object cache, so going back to a version of the script built before only relinks.
+* the new binary then runs in place of this one, with the same args.
+*/
+#ifndef AUTO_REBUILD_OPT_LEVEL
+#define AUTO_REBUILD_OPT_LEVEL 1 // the script hashes every file of the build, but 2 takes much longer to compile
+#endif
 
-            if (!MoveFileEx("_build.exe", "build.exe", MOVEFILE_REPLACE_EXISTING)) {
-                printf("failed to rename new exe to self\n");
-                return;
-            }
+struct self_deps {
+    std::string key; // of the compile that made the running binary
+    std::vector<std::pair<std::string, file_stamp>> files;
+};
 
-            return;
-        }
+bool read_self_deps(const std::string& filename, self_deps& deps) {
+    std::ifstream fid(filename);
+    if (!std::getline(fid, deps.key) || deps.key.empty()) return false;
+
+    // <mtime> <size> <file_id> <path>
+    std::string line;
+    while (std::getline(fid, line)) {
+        unsigned long long mtime, size, file_id;
+        int path_at = 0;
+        if (sscanf(line.c_str(), "%llu %llu %llu %n", &mtime, &size, &file_id, &path_at) < 3 || path_at == 0) return false;
+
+        file_stamp stamp;
+        stamp.mtime = mtime;
+        stamp.size = size;
+        stamp.file_id = file_id;
+        deps.files.push_back(std::make_pair(line.substr(path_at), stamp));
+    }
+    return deps.files.size() > 0;
+}
+
+void write_self_deps(const std::string& filename, const std::string& key, const std::vector<std::string>& files) {
+    std::string text = key + "\n";
+    for (const auto& f : files) {
+        file_stamp stamp;
+        stat_file(f, stamp);
+        text += format_str("%llu %llu %llu %s\n", (unsigned long long)stamp.mtime, (unsigned long long)stamp.size,
+                           (unsigned long long)stamp.file_id, f.c_str());
+    }
+    write_if_changed(filename, text);
+}
+
+bool self_deps_unchanged(const self_deps& deps) {
+    for (const auto& f : deps.files) {
+        file_stamp now;
+        if (!stat_file(f.first, now) || !same_stamp(f.second, now)) return false;
+    }
+    return true;
+}
+
+// hash what the compiler would see of the script, and list the files it read (sub-scripts, build.h, system headers)
+int preprocess_self(const project_config& conf, const target_config& targ, const std::string& src, hash128& out,
+                    std::vector<std::string>& includes, std::string& std_err) {
+    std::string pre_file;
+    command_args cmd = generate_preprocess_cmd(conf, targ, src, pre_file);
+    std::string dep_file = obj_file_for(conf, targ, src) + ".d";
+    if (gnu_toolchain(conf)) {
+        cmd.push_back("-MD");
+        cmd.push_back("-MF");
+        cmd.push_back(dep_file);
+    } else {
+        cmd.push_back("/showIncludes");
+    }
+
+    hash_state st;
+    hash_init(st);
+    int res = run_command_streamed(cmd, [&st](const char* data, size_t len) {
+        hash_update(st, data, len);
+    }, std_err);
+    if (res) return res;
+
+    out = hash_final(st);
+    includes = gnu_toolchain(conf) ? read_depfile(dep_file) : extract_show_includes(std_err);
+    includes.insert(includes.begin(), src);
+    return 0;
+}
+
+std::string current_exe_path(const char* argv0) {
+#ifdef _WIN32
+    char path[MAX_PATH];
+    DWORD len = GetModuleFileNameA(NULL, path, MAX_PATH);
+    if (len && len < MAX_PATH) return std::string(path, len);
+#else
+    char path[4096];
+    ssize_t len = readlink("/proc/self/exe", path, sizeof(path));
+    if (len > 0 && len < (ssize_t)sizeof(path)) return std::string(path, len);
+#endif
+    return argv0;
+}
+
+// swap new_exe in for self_exe and run it with our args, instead of this process
+void restart_self(const std::string& self_exe, const std::string& new_exe, char* argv[]) {
+#ifdef _WIN32
+    // a running exe can't be replaced, but it can be renamed out of the way (it is deleted on the next start)
+    std::string old_exe = self_exe + ".old";
+    if (!MoveFileExA(self_exe.c_str(), old_exe.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        printf("failed to rename new exe to self\n");
+        return;
+    }
+    if (!MoveFileExA(new_exe.c_str(), self_exe.c_str(), MOVEFILE_REPLACE_EXISTING)) {
+        MoveFileExA(old_exe.c_str(), self_exe.c_str(), MOVEFILE_REPLACE_EXISTING);
+        printf("failed to rename new exe to self\n");
+        return;
     }
 
+    // there is no exec, so run it on our console, wait, and exit with its exit code
+    STARTUPINFOA startup;
+    memset(&startup, 0, sizeof(startup));
+    startup.cb = sizeof(startup);
+    PROCESS_INFORMATION procinfo;
+    memset(&procinfo, 0, sizeof(procinfo));
+
+    std::string cmd_line = GetCommandLineA();
+    fflush(stdout);
+    if (!CreateProcessA(self_exe.c_str(), &cmd_line[0], NULL, NULL, TRUE, 0, NULL, NULL, &startup, &procinfo)) {
+        // put the running exe back, so the script isn't left without one
+        MoveFileExA(self_exe.c_str(), new_exe.c_str(), MOVEFILE_REPLACE_EXISTING);
+        MoveFileExA(old_exe.c_str(), self_exe.c_str(), MOVEFILE_REPLACE_EXISTING);
+        printf("Failed to start new process!\n");
+        return;
+    }
+    CloseHandle(procinfo.hThread);
+
+    DWORD exit_code = 1;
+    WaitForSingleObject(procinfo.hProcess, INFINITE);
+    GetExitCodeProcess(procinfo.hProcess, &exit_code);
+    ExitProcess(exit_code);
+#else
+    // a running binary can be renamed over
+    if (rename(new_exe.c_str(), self_exe.c_str()) != 0) {
+        printf("failed to rename new exe to self\n");
+        return;
+    }
+
+    fflush(stdout); // exec drops whatever is still buffered
+    execv(self_exe.c_str(), argv);
+    printf("Failed to start new process!\n");
+#endif
+}
+
+#define auto_rebuild_self(argc, argv) _auto_rebuild_self(argc, argv, __FILE__)
+void _auto_rebuild_self(int argc, char* argv[], const char* src_filename) {
+    (void)argc; // argv is passed on as it is
+    std::string self_exe = current_exe_path(argv[0]);
+#ifdef _WIN32
+    DeleteFileA((self_exe + ".old").c_str()); // left by the last rebuild
+#endif
+
     project_config conf;
     conf.project_name = "auto-rebuild";
     conf.cpp_standard = 14;
-    conf.bin_dir = ".\\";
-    conf.obj_dir = ".\\bin\\int";
-    conf.debug_build = true;
+    conf.bin_dir = ".";
+    conf.obj_dir = std::string(".") + path_sep + "bin" + path_sep + "int";
+    conf.debug_build = false;
     conf.static_link_std = true;
-    conf.opt_level = 0;
-    conf.opt_intrinsics = false;
+    conf.opt_level = AUTO_REBUILD_OPT_LEVEL;
+    conf.opt_intrinsics = true;
     conf.generate_debug_info = false;
     conf.incremental_link = false;
     conf.remove_unref_funcs = false;
@@ -823,6 +6081,9 @@ void _auto_rebuild_self(int argc, char* argv[], const char* src_filename) {
     targ.defines = { };
     targ.link_dir;
     targ.link_libs;
+#ifndef _WIN32
+    targ.link_libs = { "-pthread" };
+#endif
     targ.include_dirs;
     targ.src_files = { src_filename };
     targ.warnings_to_ignore = { /*4100, 4189, 4505, 4201*/ /*4723*/ };
@@ -831,85 +6092,69 @@ void _auto_rebuild_self(int argc, char* argv[], const char* src_filename) {
     targ.subsystem = "console";
     conf.targets.push_back(targ);
 
-    ensure_output_dirs(conf);
-    bool verbose = true;
-
-    // check if need to rebuild!
-    // not going to do the whole preprocess-hash to check if dependencies change,
-    // just going to look at the last-modified time of build.cpp (and maybe build.h ?)
-    // and compare to last-modified time of build.exe
-    uint64 build_cpp_stamp = get_file_timestamp(targ.src_files[0].c_str());
-    uint64 build_hpp_stamp = get_file_timestamp("build.h");
-    uint64 src_stamp = max(build_cpp_stamp, build_hpp_stamp);
-    uint64 build_exe_stamp = get_file_timestamp("build.exe");
-
-    printf("exe       timestamp: %llu\n", build_exe_stamp);
-    printf("%s        timestamp: %llu\n", src_filename, build_cpp_stamp);
-    printf("build.h   timestamp: %llu\n", build_hpp_stamp);
+    std::string targ_dir = target_obj_dir(conf, targ);
+    conf.object_cache_dir = targ_dir + path_sep + "cache";
+    conf.object_cache_max_mb = 256;
 
-    bool need_rebuild = (src_stamp >= build_exe_stamp);
+    std::string deps_file = targ_dir + path_sep + "_build.deps";
+    self_deps deps;
+    bool have_deps = read_self_deps(deps_file, deps);
+    if (have_deps && self_deps_unchanged(deps)) return;
 
-    if (need_rebuild) {
-        printf("Rebuilding self [%s]...", targ.target_name.c_str());
-        if (verbose)
-        printf("\n");
-        printf("  Generating build_cmd...");
-        std::string cmd = generate_target_build_cmd(conf, targ);
-        printf("Done.\n");
-
-        printf("    Building [%s]...", targ.target_name.c_str());
-        //int res = system(cmd.c_str());
-
-        std::string std_out, std_err;
-        int res = run_command(cmd, std_out, std_err);
+    ensure_output_dirs(conf);
 
-        if (res) {
-            printf("Failed! ErrorCode: %d\n", res);
-            printf("%s\n", std_out.c_str());
-            printf("%s\n", std_err.c_str());
-            return;
+    const std::string& src = targ.src_files[0];
+    hash128 pre_hash;
+    std::vector<std::string> includes;
+    std::string std_out, std_err;
+    int res = preprocess_self(conf, targ, src, pre_hash, includes, std_err);
+    if (res) {
+        // keep going with the binary we have, the build may still work
+        printf("Rebuilding self [%s]...Failed! ErrorCode: %d\n%s\n", targ.target_name.c_str(), res, std_err.c_str());
+        return;
+    }
+    std::string key = object_cache_key(conf, targ, src, pre_hash);
+
+    // the first time, there is nothing recorded to compare to: rebuild if anything is newer than the binary
+    bool up_to_date = have_deps ? key == deps.key : true;
+    if (!have_deps) {
+        uint64 exe_stamp = get_file_timestamp(self_exe.c_str());
+        for (const auto& f : includes) {
+            if (get_file_timestamp(f.c_str()) >= exe_stamp) up_to_date = false;
         }
+    }
+    if (up_to_date) {
+        write_self_deps(deps_file, key, includes);
+        return;
+    }
 
-        printf("Done.\n");
-
-        // create a new process
-        STARTUPINFO siStartInfo;
-        memset(&siStartInfo, 0, sizeof(siStartInfo));
-
-        siStartInfo.cb = sizeof(STARTUPINFO);
-        // info.hStdInput  = duplicate_handle_as_inheritable(GetStdHandle(STD_INPUT_HANDLE));
-        // info.hStdOutput = duplicate_handle_as_inheritable(GetStdHandle(STD_OUTPUT_HANDLE));
-        // info.hStdError  = duplicate_handle_as_inheritable(GetStdHandle(STD_ERROR_HANDLE));
-        // info.dwFlags |= STARTF_USESTDHANDLES;
-
-        PROCESS_INFORMATION procinfo;
-        memset(&procinfo, 0, sizeof(procinfo));
-
-        auto result = CreateProcessA(
-            "_build.exe",          // LPCSTR                   lpApplicationName
-            "_build.exe rebuild",  // LPSTR                    lpCommandLine
-            nullptr,               // LPSECURITY_ATTRIBUTES    lpProcessAttributes
-            nullptr,               // LPSECURITY_ATTRIBUTES    lpThreadAttributes
-            true,                  // BOOL                     bInheritHandles
-            0,                     // DWORD                    dwCreationFlags
-            nullptr,               // LPVOID                   lpEnvironment
-            nullptr,               // LPCSTR                   lpCurrentDirectory
-            &siStartInfo,          // LPSTARTUPINFO            lpStartupInfo
-            &procinfo              // LPPROCESS_INFORMATION    lpProcessInformation
-        );
-
-        if (!result) {
-            printf("Failed to start new process!\n");
-            return;
-        }
+    printf("Rebuilding self [%s]...", targ.target_name.c_str());
+    uint64 start_us = trace_now_us();
+    std::string obj_file = obj_file_for(conf, targ, src);
+    std::vector<std::string> cached_includes;
+    bool cached = object_cache_fetch(conf, key, obj_file, cached_includes);
+    if (!cached) {
+        res = run_command(generate_compile_cmd(conf, targ, src), std_out, std_err);
+        if (res == 0) object_cache_store(conf, key, obj_file, includes);
+    }
+    if (res == 0) {
+        res = run_command(generate_link_cmd(conf, targ), std_out, std_err);
+    }
+    if (res) {
+        printf("Failed! ErrorCode: %d\n", res);
+        printf("%s\n", std_out.c_str());
+        printf("%s\n", std_err.c_str());
+        return;
+    }
+    printf("Done%s.\n", cached ? " (cached object)" : "");
 
-        CloseHandle(procinfo.hThread);
+    write_self_deps(deps_file, key, includes);
+    trim_object_cache(conf);
 
-        // exit without waiting for child to finish!
-        // ideally, by the timt the child process needs to access 
-        // the file build.exe, this process will be done.
-        ExitProcess(0);
-    }
+    // the new binary puts this in its timeline, if it records one
+    set_env(trace_rebuild_env, format_str("%llu %llu %d", (unsigned long long)start_us, (unsigned long long)trace_now_us(), res));
+
+    restart_self(self_exe, target_output_file(conf, targ), argv);
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,232 @@
+// benchmarks the build tool on a project written by tools/gen_project.cpp.
+//   cl.exe /O2 /EHsc tools\build_bench.cpp /Fe:build_bench.exe
+//   g++ -O2 -pthread tools/build_bench.cpp -o build_bench
+//
+//   build_bench <project_dir> [--runs N] [-j N] [--include <dir of build.h>] [--json out.json]
+//
+// compiles the project's build-script (cl.exe, or $CXX / g++ elsewhere) and times four scenarios:
+//   full    everything rebuilt from a clean bin dir
+//   no-op   nothing changed
+//   leaf    one source of the last target edited
+//   header  common.h, which every source includes, edited
+// each build runs with `--trace`, and the trace splits its wall time into time spent in child
+// processes (preprocess, compile, link) and the tool's own time, when no child was running.
+// run it from the repo root, or pass --include.
+#include "../build.h"
+#include <chrono>
+#include <ctime>
+
+#ifdef _WIN32
+#include <direct.h>
+#define getcwd _getcwd
+#define chdir _chdir
+static const char* build_exe = ".\\build.exe";
+#else
+static const char* build_exe = "./build";
+#endif
+
+struct bench_run {
+    double wall_ms = 0;
+    double proc_ms = 0;  // summed over all child processes
+    double busy_ms = 0;  // time at least one child was running
+    int spawns = 0;
+    int exit_code = 0;
+
+    double self_ms() const { return wall_ms > busy_ms ? wall_ms - busy_ms : 0; }
+};
+
+bool read_text(const std::string& filename, std::string& text) {
+    std::ifstream in(filename, std::ios::binary);
+    if (!in) return false;
+    text.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+    return true;
+}
+
+// every action in the trace that ran a process (see trace_event::kind)
+bool is_spawn(const std::string& kind) {
+    return kind == "preprocess" || kind == "compile" || kind == "remote" || kind == "link" || kind == "build";
+}
+
+bool read_trace(const std::string& filename, bench_run& run) {
+    std::string json;
+    if (!read_text(filename, json)) return false;
+
+    std::vector<std::pair<uint64, uint64>> spans;
+    const std::string cat_key = "\"cat\":\"";
+    for (size_t at = json.find(cat_key); at != std::string::npos; at = json.find(cat_key, at + 1)) {
+        size_t kind_start = at + cat_key.size();
+        std::string kind = json.substr(kind_start, json.find('"', kind_start) - kind_start);
+        if (!is_spawn(kind)) continue;
+
+        size_t ts  = json.find("\"ts\":", at);
+        size_t dur = json.find("\"dur\":", at);
+        if (ts == std::string::npos || dur == std::string::npos) break;
+        uint64 start = strtoull(json.c_str() + ts + 5, NULL, 10);
+        uint64 len   = strtoull(json.c_str() + dur + 6, NULL, 10);
+        spans.push_back(std::make_pair(start, start + len));
+        run.proc_ms += len / 1000.0;
+        run.spawns++;
+    }
+
+    // union of the spans
+    std::sort(spans.begin(), spans.end());
+    uint64 busy = 0, end = 0;
+    for (const auto& s : spans) {
+        uint64 from = (std::max)(s.first, end);
+        if (s.second > from) busy += s.second - from;
+        end = (std::max)(end, s.second);
+    }
+    run.busy_ms = busy / 1000.0;
+    return true;
+}
+
+// rewrite the number after the first `bench_edit... = ` in the file, so it really changes
+bool bump_edit(const std::string& filename, int value) {
+    std::string text;
+    if (!read_text(filename, text)) return false;
+
+    size_t at = text.find("bench_edit");
+    if (at == std::string::npos) return false;
+    size_t num = text.find('=', at);
+    size_t semi = text.find(';', at);
+    if (num == std::string::npos || semi == std::string::npos || semi < num) return false;
+
+    text = text.substr(0, num) + "= " + std::to_string(value) + text.substr(semi);
+    std::ofstream out(filename, std::ios::binary | std::ios::trunc);
+    out << text;
+    return (bool)out;
+}
+
+void remove_dir(const std::string& dir) {
+    std::string out, err;
+#ifdef _WIN32
+    run_command({"cmd.exe", "/c", "rmdir", "/s", "/q", dir}, out, err);
+#else
+    run_command({"rm", "-rf", dir}, out, err);
+#endif
+}
+
+int main(int argc, char* argv[]) {
+    std::string project_dir, include_dir, json_file, jobs;
+    int runs = 3;
+    for (int n = 1; n < argc; n++) {
+        std::string a = argv[n];
+        bool has_value = n + 1 < argc;
+        if      (a == "--runs" && has_value)    runs = (std::max)(1, atoi(argv[++n]));
+        else if (a == "-j" && has_value)        jobs = argv[++n];
+        else if (a == "--include" && has_value) include_dir = argv[++n];
+        else if (a == "--json" && has_value)    json_file = argv[++n];
+        else if (a[0] != '-' && project_dir.empty()) project_dir = a;
+        else {
+            printf("unknown argument [%s]\n", a.c_str());
+            return 1;
+        }
+    }
+    if (project_dir.empty()) {
+        printf("usage: build_bench <project_dir> [--runs N] [-j N] [--include <dir of build.h>] [--json out.json]\n");
+        return 1;
+    }
+
+    // paths given on the command line are relative to where we started
+    char cwd[4096];
+    if (!getcwd(cwd, sizeof(cwd))) return 1;
+    include_dir = absolute_path(include_dir.size() ? include_dir : std::string(cwd));
+    if (json_file.size()) json_file = absolute_path(json_file);
+    if (chdir(project_dir.c_str()) != 0) {
+        printf("no project at [%s]\n", project_dir.c_str());
+        return 1;
+    }
+
+    std::string leaf, header, clean;
+    {
+        std::ifstream manifest("bench.txt");
+        std::string key, value;
+        while (manifest >> key >> value) {
+            if (key == "leaf")   leaf = value;
+            if (key == "header") header = value;
+            if (key == "clean")  clean = value;
+        }
+        if (leaf.empty() || header.empty() || clean.empty()) {
+            printf("[%s] has no bench.txt, generate it with tools/gen_project.cpp\n", project_dir.c_str());
+            return 1;
+        }
+    }
+
+    printf("Compiling the build-script...\n");
+    {
+#ifdef _WIN32
+        command_args cmd = {"cl.exe", "/nologo", "/O2", "/EHsc", "/I" + include_dir, "build.cpp", "/Fe:build.exe"};
+#else
+        const char* cxx = getenv("CXX");
+        command_args cmd = {cxx ? cxx : "g++", "-O2", "-std=c++14", "-pthread", "-I" + include_dir, "build.cpp", "-o", "build"};
+#endif
+        std::string out, err;
+        int res = run_command(cmd, out, err);
+        if (res) {
+            printf("%s%s\nfailed! ErrorCode: %d\n", out.c_str(), err.c_str(), res);
+            return res;
+        }
+    }
+
+    const char* scenarios[] = { "full", "no-op", "leaf", "header" };
+    const int num_scenarios = 4;
+    std::vector<bench_run> results;
+    int edit_value = (int)time(NULL);
+
+    printf("%-8s %10s %10s %10s %10s %7s\n", "", "wall ms", "self ms", "busy ms", "proc ms", "spawns");
+    for (int s = 0; s < num_scenarios; s++) {
+        std::string scenario = scenarios[s];
+        std::vector<bench_run> timings;
+        for (int r = 0; r < runs; r++) {
+            if (scenario == "full")   remove_dir(clean);
+            if (scenario == "leaf")   bump_edit(leaf, edit_value++);
+            if (scenario == "header") bump_edit(header, edit_value++);
+            // the full builds leave it up to date for the first no-op run
+
+            std::string trace = "bench_trace.json";
+            command_args cmd = {build_exe, "--trace", trace};
+            if (jobs.size()) {
+                cmd.push_back("-j");
+                cmd.push_back(jobs);
+            }
+
+            bench_run run;
+            std::string out, err;
+            auto start = std::chrono::steady_clock::now();
+            run.exit_code = run_command(cmd, out, err);
+            run.wall_ms = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+            if (run.exit_code) {
+                printf("%s%s\n[%s] build failed! ErrorCode: %d\n", out.c_str(), err.c_str(), scenario.c_str(), run.exit_code);
+                return run.exit_code;
+            }
+            if (!read_trace(trace, run)) {
+                printf("[%s] wrote no trace\n", scenario.c_str());
+                return 1;
+            }
+            timings.push_back(run);
+        }
+
+        // the median run by wall time
+        std::sort(timings.begin(), timings.end(), [](const bench_run& a, const bench_run& b) { return a.wall_ms < b.wall_ms; });
+        const bench_run& m = timings[timings.size() / 2];
+        results.push_back(m);
+        printf("%-8s %10.1f %10.1f %10.1f %10.1f %7d\n", scenario.c_str(), m.wall_ms, m.self_ms(), m.busy_ms, m.proc_ms, m.spawns);
+    }
+
+    if (json_file.size()) {
+        std::string json = "{\"runs\":" + std::to_string(runs) + ",\"scenarios\":[";
+        for (int s = 0; s < num_scenarios; s++) {
+            const bench_run& m = results[s];
+            json += format_str("%s\n{\"name\":\"%s\",\"wall_ms\":%.1f,\"self_ms\":%.1f,\"busy_ms\":%.1f,\"proc_ms\":%.1f,\"spawns\":%d}",
+                               s ? "," : "", scenarios[s], m.wall_ms, m.self_ms(), m.busy_ms, m.proc_ms, m.spawns);
+        }
+        json += "\n]}\n";
+        std::ofstream out(json_file, std::ios::binary | std::ios::trunc);
+        out << json;
+        if (!out) {
+            printf("failed to write [%s]\n", json_file.c_str());
+            return 1;
+        }
+    }
+    return 0;
+}
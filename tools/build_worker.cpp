@@ -0,0 +1,184 @@
+// compiles sources for other machines' builds (project_config::remote_workers).
+//   cl.exe /O2 /EHsc tools\build_worker.cpp /Fe:build_worker.exe
+//   g++ -O2 -pthread tools/build_worker.cpp -o build_worker
+//
+//   build_worker [--listen <addr>] [--port N] [-j N] [--tmp <dir>] [--allow <compiler>]...
+//
+// each connection sends one preprocessed source and the command to compile it, and gets back the
+// exit code, the compiler's output and the object file (the protocol is above build_worker_port
+// in build.h). at most -j compiles run at once, the others wait their turn.
+// only the compilers given with --allow are run (cl.exe, g++, gcc, clang++ and clang if none are),
+// but their flags are passed on as they are, so only listen where the builds can be trusted.
+// it listens on 127.0.0.1 unless told otherwise.
+#include "../build.h"
+
+#ifndef _WIN32
+#include <signal.h>
+#endif
+
+struct worker_config {
+    std::string listen_addr = "127.0.0.1";
+    std::string port = build_worker_port;
+    unsigned int jobs = std::thread::hardware_concurrency();
+    std::string tmp_dir = "build_worker_tmp";
+    std::vector<std::string> allow;
+};
+
+worker_config worker;
+
+// compiles running now, at most worker.jobs
+std::mutex job_lock;
+std::condition_variable job_freed;
+unsigned int jobs_running = 0;
+
+std::atomic<unsigned int> request_count(0);
+
+// just the file name, whatever the client sent
+std::string base_name(const std::string& path) {
+    size_t slash = path.find_last_of("/\\");
+    std::string name = slash == std::string::npos ? path : path.substr(slash + 1);
+    return name.empty() || name == "." || name == ".." ? "input" : name;
+}
+
+bool allowed_program(const std::string& program) {
+    for (const auto& a : worker.allow) {
+        if (program == a) return true;
+    }
+    return false;
+}
+
+bool send_reply(net_socket s, int exit_code, const std::string& std_out, const std::string& std_err, const std::string& object) {
+    wire_writer reply;
+    reply.buf = "BLD1";
+    reply.u32((uint32_t)exit_code);
+    reply.str(std_out);
+    reply.str(std_err);
+    reply.str(object);
+    return net_send_all(s, reply.buf.data(), reply.buf.size());
+}
+
+void handle_request(net_socket s, std::string peer) {
+    net_set_timeout(s, 300);
+
+    uint32_t argc = 0;
+    command_args args;
+    std::string input_name, input;
+    bool ok = net_recv_magic(s) && net_recv_u32(s, argc) && argc > 0 && argc < 4096;
+    for (uint32_t n = 0; ok && n < argc; n++) {
+        std::string a;
+        ok = net_recv_str(s, a);
+        args.push_back(a);
+    }
+    ok = ok && net_recv_str(s, input_name) && net_recv_str(s, input);
+    if (!ok) {
+        printf("[%s] bad request\n", peer.c_str());
+        net_close(s);
+        return;
+    }
+    if (!allowed_program(args[0])) {
+        printf("[%s] refused [%s]\n", peer.c_str(), args[0].c_str());
+        send_reply(s, -1, "", "build_worker: [" + args[0] + "] is not an allowed compiler\n", "");
+        net_close(s);
+        return;
+    }
+
+    // files of different requests can't collide
+    std::string prefix = worker.tmp_dir + path_sep + std::to_string(++request_count) + "_";
+    std::string in_file  = prefix + base_name(input_name);
+    std::string out_file = prefix + file_stem(base_name(input_name)) + ".o";
+    for (auto& a : args) {
+        size_t at;
+        while ((at = a.find("{in}")) != std::string::npos)  a.replace(at, 4, in_file);
+        while ((at = a.find("{out}")) != std::string::npos) a.replace(at, 5, out_file);
+    }
+
+    int res = -1;
+    std::string std_out, std_err, object;
+    {
+        std::ofstream fid(in_file, std::ios::binary | std::ios::trunc);
+        fid.write(input.data(), input.size());
+    }
+
+    uint64 start_us = trace_now_us();
+    {
+        std::unique_lock<std::mutex> guard(job_lock);
+        job_freed.wait(guard, []() { return jobs_running < worker.jobs; });
+        jobs_running++;
+    }
+    res = run_command(args, std_out, std_err);
+    {
+        std::lock_guard<std::mutex> guard(job_lock);
+        jobs_running--;
+    }
+    job_freed.notify_one();
+
+    if (res == 0) {
+        std::ifstream fid(out_file, std::ios::binary);
+        object.assign(std::istreambuf_iterator<char>(fid), std::istreambuf_iterator<char>());
+    }
+    delete_file(in_file);
+    delete_file(out_file);
+
+    send_reply(s, res, std_out, std_err, object);
+    net_close(s);
+
+    printf("[%s] %s -> %d (%.1f ms, %d bytes)\n", peer.c_str(), base_name(input_name).c_str(), res,
+           (trace_now_us() - start_us) / 1000.0, (int)object.size());
+    fflush(stdout);
+}
+
+int main(int argc, char* argv[]) {
+    for (int n = 1; n < argc; n++) {
+        std::string a = argv[n];
+        bool has_value = n + 1 < argc;
+        if      (a == "--listen" && has_value) worker.listen_addr = argv[++n];
+        else if (a == "--port" && has_value)   worker.port = argv[++n];
+        else if (a == "-j" && has_value)       worker.jobs = (std::max)(1, atoi(argv[++n]));
+        else if (a == "--tmp" && has_value)    worker.tmp_dir = argv[++n];
+        else if (a == "--allow" && has_value)  worker.allow.push_back(argv[++n]);
+        else {
+            printf("usage: build_worker [--listen <addr>] [--port N] [-j N] [--tmp <dir>] [--allow <compiler>]...\n");
+            return 1;
+        }
+    }
+    if (worker.jobs == 0) worker.jobs = 1;
+    if (worker.allow.empty()) worker.allow = {"cl.exe", "g++", "gcc", "clang++", "clang"};
+    make_dirs(worker.tmp_dir);
+
+#ifndef _WIN32
+    signal(SIGPIPE, SIG_IGN); // a client that went away is a failed send
+#endif
+    net_startup();
+
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    hints.ai_flags = AI_PASSIVE;
+    addrinfo* found = NULL;
+    if (getaddrinfo(worker.listen_addr.c_str(), worker.port.c_str(), &hints, &found) != 0 || !found) {
+        printf("can't listen on [%s:%s]\n", worker.listen_addr.c_str(), worker.port.c_str());
+        return 1;
+    }
+    net_socket listener = socket(found->ai_family, found->ai_socktype, found->ai_protocol);
+    int one = 1;
+    setsockopt(listener, SOL_SOCKET, SO_REUSEADDR, (const char*)&one, sizeof(one));
+    bool ok = listener != net_invalid && bind(listener, found->ai_addr, (int)found->ai_addrlen) == 0 && listen(listener, 64) == 0;
+    freeaddrinfo(found);
+    if (!ok) {
+        printf("can't listen on [%s:%s]\n", worker.listen_addr.c_str(), worker.port.c_str());
+        return 1;
+    }
+
+    printf("build_worker listening on %s:%s, %u jobs\n", worker.listen_addr.c_str(), worker.port.c_str(), worker.jobs);
+    fflush(stdout);
+    while (true) {
+        sockaddr_storage addr;
+        socklen_t len = sizeof(addr);
+        net_socket s = accept(listener, (sockaddr*)&addr, &len);
+        if (s == net_invalid) continue;
+
+        char host[256] = "?";
+        getnameinfo((sockaddr*)&addr, len, host, sizeof(host), NULL, 0, NI_NUMERICHOST);
+        std::thread(handle_request, s, std::string(host)).detach();
+    }
+}
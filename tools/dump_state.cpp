@@ -0,0 +1,13 @@
+// prints a build state file (obj_dir\<project>.state) as text.
+//   cl.exe tools\dump_state.cpp /Fe:dump_state.exe
+//   dump_state.exe bin\int\test.state
+#include "../build.h"
+
+int main(int argc, char* argv[]) {
+    if (argc != 2) {
+        printf("usage: %s <file.state>\n", argv[0]);
+        return 1;
+    }
+
+    return dump_build_state(argv[1]);
+}
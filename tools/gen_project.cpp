@@ -0,0 +1,216 @@
+// writes a synthetic project (sources, headers and a build-script) for benchmarking the build tool itself.
+//   cl.exe /O2 /EHsc tools\gen_project.cpp /Fe:gen_project.exe
+//   g++ -O2 tools/gen_project.cpp -o gen_project
+//
+//   gen_project <out_dir> [--targets N] [--sources N] [--headers N] [--fanout N] [--depth N]
+//
+// every target gets `sources` .cpp files and `headers` headers of its own. each source includes
+// `fanout` of them, each header includes the next one (so includes nest) and common.h, which
+// every source ends up including. targets form dependency chains `depth` targets long, and a
+// target's sources also include a header of the target it depends on.
+// the targets are all executables, so the chains only order the build, nothing is linked across.
+//
+// bench.txt lists the files tools/build_bench.cpp edits and the dirs it cleans.
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+#ifdef _WIN32
+#include <direct.h>
+static const char sep = '\\';
+static bool make_dir(const std::string& dir) { return _mkdir(dir.c_str()) == 0 || errno == EEXIST; }
+#else
+#include <sys/stat.h>
+static const char sep = '/';
+static bool make_dir(const std::string& dir) { return mkdir(dir.c_str(), 0755) == 0 || errno == EEXIST; }
+#endif
+
+struct gen_config {
+    std::string out_dir;
+    int targets = 4;
+    int sources = 50;
+    int headers = 20;
+    int fanout  = 5;
+    int depth   = 2;
+};
+
+std::string path_join(const std::string& a, const std::string& b) {
+    return a + sep + b;
+}
+
+// paths inside the generated build-script are string literals
+std::string literal(const std::string& path) {
+    std::string out;
+    for (char c : path) {
+        if (c == '\\') out += '\\';
+        out += c;
+    }
+    return out;
+}
+
+bool write_file(const std::string& filename, const std::string& text) {
+    FILE* fid = fopen(filename.c_str(), "wb");
+    if (!fid) {
+        printf("could not write [%s]\n", filename.c_str());
+        return false;
+    }
+    fwrite(text.data(), 1, text.size(), fid);
+    return fclose(fid) == 0;
+}
+
+std::string target_name(int t) {
+    return "t" + std::to_string(t);
+}
+
+// the target t depends on, or -1 at the start of a chain
+int dependency_of(const gen_config& gen, int t) {
+    if (gen.depth <= 1 || t % gen.depth == 0) return -1;
+    return t - 1;
+}
+
+// enough declarations and inline code that parsing a header costs something
+std::string header_text(const gen_config& gen, int t, int h) {
+    std::string name = target_name(t) + "_h" + std::to_string(h);
+    std::string text = "#pragma once\n#include \"common.h\"\n";
+    if (h + 1 < gen.headers) text += "#include \"h" + std::to_string(h + 1) + ".h\"\n";
+    text += "\nstruct " + name + " {\n";
+    for (int m = 0; m < 8; m++) text += "    int m" + std::to_string(m) + ";\n";
+    for (int f = 0; f < 8; f++) {
+        std::string fn = std::to_string(f);
+        text += "    inline int f" + fn + "(int x) const { return bench_mix(x, m" + fn + ") + m" + std::to_string((f + 1) % 8) + "; }\n";
+    }
+    text += "};\n";
+    text += "template <typename T> inline T " + name + "_sum(const T* v, int n) { T s = T(); for (int i = 0; i < n; i++) s += v[i]; return s; }\n";
+    return text;
+}
+
+std::string source_text(const gen_config& gen, int t, int s) {
+    std::string text;
+    std::vector<int> used;
+    for (int f = 0; f < gen.fanout && f < gen.headers; f++) {
+        int h = (s * 7 + f * 3) % gen.headers;
+        bool dup = false;
+        for (int u : used) dup |= u == h;
+        if (dup) continue;
+        used.push_back(h);
+        text += "#include \"h" + std::to_string(h) + ".h\"\n";
+    }
+    int dep = dependency_of(gen, t);
+    if (dep >= 0) text += "#include \"" + target_name(dep) + "_api.h\"\n";
+
+    text += "\nstatic const int bench_edit = 0;\n\n";
+    text += "int " + target_name(t) + "_s" + std::to_string(s) + "(int x) {\n    int r = x + bench_edit;\n";
+    for (int h : used) {
+        std::string name = target_name(t) + "_h" + std::to_string(h);
+        text += "    { " + name + " v = {}; r += v.f" + std::to_string(h % 8) + "(r); }\n";
+    }
+    text += "    return r;\n}\n";
+
+    if (s == 0) {
+        text += "\nint main(int argc, char** argv) {\n    return " + target_name(t) + "_s0(argc) == 12345 ? 1 : 0;\n}\n";
+    }
+    return text;
+}
+
+int parse_int(const char* arg, int fallback) {
+    int v = atoi(arg);
+    return v > 0 ? v : fallback;
+}
+
+int main(int argc, char* argv[]) {
+    gen_config gen;
+    for (int n = 1; n < argc; n++) {
+        const char* a = argv[n];
+        bool has_value = n + 1 < argc;
+        if      (strcmp(a, "--targets") == 0 && has_value) gen.targets = parse_int(argv[++n], gen.targets);
+        else if (strcmp(a, "--sources") == 0 && has_value) gen.sources = parse_int(argv[++n], gen.sources);
+        else if (strcmp(a, "--headers") == 0 && has_value) gen.headers = parse_int(argv[++n], gen.headers);
+        else if (strcmp(a, "--fanout")  == 0 && has_value) gen.fanout  = parse_int(argv[++n], gen.fanout);
+        else if (strcmp(a, "--depth")   == 0 && has_value) gen.depth   = parse_int(argv[++n], gen.depth);
+        else if (a[0] != '-' && gen.out_dir.empty())        gen.out_dir = a;
+        else {
+            printf("unknown argument [%s]\n", a);
+            return 1;
+        }
+    }
+    if (gen.out_dir.empty()) {
+        printf("usage: gen_project <out_dir> [--targets N] [--sources N] [--headers N] [--fanout N] [--depth N]\n");
+        return 1;
+    }
+
+    std::string common_dir = path_join(gen.out_dir, "common");
+    if (!make_dir(gen.out_dir) || !make_dir(common_dir)) {
+        printf("could not create [%s]\n", gen.out_dir.c_str());
+        return 1;
+    }
+    std::string common_h = path_join(common_dir, "common.h");
+    if (!write_file(common_h,
+                    "#pragma once\n"
+                    "static const int bench_edit_common = 0;\n"
+                    "inline int bench_mix(int a, int b) { return (a * 31) ^ (b + bench_edit_common); }\n")) return 1;
+
+    // paths in the build-script are relative to out_dir, where build_bench runs it
+    std::string script =
+        "// generated by tools/gen_project.cpp\n"
+        "#include \"build.h\" // tools/build_bench.cpp passes its dir as an include dir\n\n"
+        "int main(int argc, char** argv) {\n"
+        "    project_config conf;\n"
+        "    conf.project_name = \"bench\";\n"
+        "    conf.cpp_standard = 14;\n"
+        "    conf.bin_dir = \"" + literal(path_join(".", "bin")) + "\";\n"
+        "    conf.obj_dir = \"" + literal(path_join(path_join(".", "bin"), "int")) + "\";\n"
+        "    conf.opt_level = 0;\n"
+        "    conf.generate_debug_info = false;\n"
+        "    parse_build_args(conf, argc, argv);\n";
+
+    std::string leaf_src;
+    for (int t = 0; t < gen.targets; t++) {
+        std::string name = target_name(t);
+        std::string dir = path_join(gen.out_dir, name);
+        if (!make_dir(dir)) {
+            printf("could not create [%s]\n", dir.c_str());
+            return 1;
+        }
+
+        for (int h = 0; h < gen.headers; h++) {
+            if (!write_file(path_join(dir, "h" + std::to_string(h) + ".h"), header_text(gen, t, h))) return 1;
+        }
+        // what dependent targets include
+        if (!write_file(path_join(dir, name + "_api.h"), "#pragma once\n#include \"h0.h\"\n")) return 1;
+
+        script += "\n    {\n"
+                  "        target_config targ;\n"
+                  "        targ.target_name = \"" + name + "\";\n"
+                  "        targ.type = executable;\n"
+                  "        targ.include_dirs = { \"" + literal(path_join(".", "common")) + "\", \"" + literal(path_join(".", name)) + "\"";
+        int dep = dependency_of(gen, t);
+        if (dep >= 0) script += ", \"" + literal(path_join(".", target_name(dep))) + "\"";
+        script += " };\n";
+        if (dep >= 0) script += "        targ.depends_on = { \"" + target_name(dep) + "\" };\n";
+
+        for (int s = 0; s < gen.sources; s++) {
+            std::string src = "s" + std::to_string(s) + ".cpp";
+            if (!write_file(path_join(dir, src), source_text(gen, t, s))) return 1;
+            script += "        targ.src_files.push_back(\"" + literal(path_join(path_join(".", name), src)) + "\");\n";
+        }
+        leaf_src = path_join(name, "s" + std::to_string(gen.sources - 1) + ".cpp");
+
+        script += "        conf.targets.push_back(targ);\n"
+                  "    }\n";
+    }
+    script += "\n    return build_project_incremental(conf);\n}\n";
+    if (!write_file(path_join(gen.out_dir, "build.cpp"), script)) return 1;
+
+    std::string manifest =
+        "leaf " + leaf_src + "\n"
+        "header " + path_join("common", "common.h") + "\n"
+        "clean bin\n";
+    if (!write_file(path_join(gen.out_dir, "bench.txt"), manifest)) return 1;
+
+    printf("wrote %d targets x %d sources (%d headers each, fan-out %d, depth %d) to %s\n",
+           gen.targets, gen.sources, gen.headers, gen.fanout, gen.depth, gen.out_dir.c_str());
+    return 0;
+}
@@ -0,0 +1,190 @@
+// compares the built-in content hash against the MD5 hashing change detection used to do,
+// on files the size of typical preprocessed (.i) outputs.
+//   cl.exe /O2 tools\hash_bench.cpp /Fe:hash_bench.exe
+//   g++ -O2 -pthread tools/hash_bench.cpp -o hash_bench
+#include "../build.h"
+#include <chrono>
+
+#ifdef _WIN32
+#include <msi.h>
+#pragma comment( lib, "Msi" )
+
+const char* md5_name = "MsiGetFileHashA (MD5)";
+bool md5_file(const std::string& filename) {
+    MSIFILEHASHINFO info;
+    info.dwFileHashInfoSize = sizeof(MSIFILEHASHINFO);
+    return MsiGetFileHashA(filename.c_str(), 0, &info) == ERROR_SUCCESS;
+}
+#else
+// there's no MsiGetFileHashA outside of windows, so compare against a plain RFC 1321 MD5
+const char* md5_name = "reference MD5";
+
+struct md5_state {
+    uint32_t a, b, c, d;
+};
+
+inline uint32_t md5_rotl(uint32_t x, int c) { return (x << c) | (x >> (32 - c)); }
+
+void md5_block(md5_state& st, const unsigned char* p) {
+    static const uint32_t K[64] = {
+        0xd76aa478, 0xe8c7b756, 0x242070db, 0xc1bdceee, 0xf57c0faf, 0x4787c62a, 0xa8304613, 0xfd469501,
+        0x698098d8, 0x8b44f7af, 0xffff5bb1, 0x895cd7be, 0x6b901122, 0xfd987193, 0xa679438e, 0x49b40821,
+        0xf61e2562, 0xc040b340, 0x265e5a51, 0xe9b6c7aa, 0xd62f105d, 0x02441453, 0xd8a1e681, 0xe7d3fbc8,
+        0x21e1cde6, 0xc33707d6, 0xf4d50d87, 0x455a14ed, 0xa9e3e905, 0xfcefa3f8, 0x676f02d9, 0x8d2a4c8a,
+        0xfffa3942, 0x8771f681, 0x6d9d6122, 0xfde5380c, 0xa4beea44, 0x4bdecfa9, 0xf6bb4b60, 0xbebfbc70,
+        0x289b7ec6, 0xeaa127fa, 0xd4ef3085, 0x04881d05, 0xd9d4d039, 0xe6db99e5, 0x1fa27cf8, 0xc4ac5665,
+        0xf4292244, 0x432aff97, 0xab9423a7, 0xfc93a039, 0x655b59c3, 0x8f0ccc92, 0xffeff47d, 0x85845dd1,
+        0x6fa87e4f, 0xfe2ce6e0, 0xa3014314, 0x4e0811a1, 0xf7537e82, 0xbd3af235, 0x2ad7d2bb, 0xeb86d391 };
+    static const int R[64] = {
+        7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22, 7, 12, 17, 22,
+        5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20, 5,  9, 14, 20,
+        4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23, 4, 11, 16, 23,
+        6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21, 6, 10, 15, 21 };
+
+    uint32_t m[16];
+    memcpy(m, p, 64);
+
+    uint32_t a = st.a, b = st.b, c = st.c, d = st.d;
+    for (int i = 0; i < 64; i++) {
+        uint32_t f;
+        int g;
+        if      (i < 16) { f = (b & c) | (~b & d); g = i; }
+        else if (i < 32) { f = (d & b) | (~d & c); g = (5*i + 1) % 16; }
+        else if (i < 48) { f = b ^ c ^ d;          g = (3*i + 5) % 16; }
+        else             { f = c ^ (b | ~d);       g = (7*i) % 16; }
+
+        uint32_t tmp = d;
+        d = c;
+        c = b;
+        b = b + md5_rotl(a + f + K[i] + m[g], R[i]);
+        a = tmp;
+    }
+    st.a += a; st.b += b; st.c += c; st.d += d;
+}
+
+bool md5_file(const std::string& filename) {
+    FILE* fid = fopen(filename.c_str(), "rb");
+    if (!fid) return false;
+
+    md5_state st = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+    std::vector<unsigned char> buf(64 * 1024 + 128);
+    uint64 total = 0;
+    size_t rest = 0; // bytes at the start of buf that don't fill a block yet
+    size_t n;
+    while ((n = fread(buf.data() + rest, 1, 64 * 1024, fid)) > 0) {
+        total += n;
+        n += rest;
+        size_t blocks = n / 64;
+        for (size_t b = 0; b < blocks; b++) md5_block(st, buf.data() + 64*b);
+
+        rest = n - blocks*64;
+        memmove(buf.data(), buf.data() + blocks*64, rest);
+    }
+    fclose(fid);
+
+    // pad with 0x80, zeros and the bit length
+    buf[rest++] = 0x80;
+    while (rest % 64 != 56) buf[rest++] = 0;
+    uint64 bits = total * 8;
+    memcpy(buf.data() + rest, &bits, 8);
+    rest += 8;
+    for (size_t b = 0; b < rest / 64; b++) md5_block(st, buf.data() + 64*b);
+
+    return true;
+}
+#endif
+
+// something that looks roughly like preprocessor output
+void write_test_file(const std::string& filename, size_t size) {
+    static const char* lines[] = {
+        "#line 1042 \"c:\\\\program files\\\\msvc\\\\include\\\\xstring\"\n",
+        "template <class _Elem, class _Traits = char_traits<_Elem>, class _Alloc = allocator<_Elem>>\n",
+        "    _CONSTEXPR20 basic_string& append(const _Elem* const _Ptr, const size_type _Count) {\n",
+        "        return _Reallocate_grow_by(_Count, [](_Elem* const _New_ptr, const _Elem* const _Old_ptr) {\n",
+        "    }\n",
+        "\n",
+        "typedef unsigned long long uint64_t;\n",
+    };
+
+    FILE* fid = fopen(filename.c_str(), "wb");
+    size_t written = 0;
+    unsigned int seed = 12345;
+    while (written < size) {
+        seed = seed * 1103515245u + 12345u;
+        const char* line = lines[(seed >> 16) % (sizeof(lines) / sizeof(lines[0]))];
+        size_t len = strlen(line);
+        if (written + len > size) len = size - written;
+        fwrite(line, 1, len, fid);
+        written += len;
+    }
+    fclose(fid);
+}
+
+double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+int main() {
+    const size_t sizes[] = { 64 * 1024, 512 * 1024, 2 * 1024 * 1024, 8 * 1024 * 1024, 32 * 1024 * 1024 };
+    const double min_seconds = 0.5;
+
+    printf("%-12s %14s %14s %10s\n", "size", "hash128 MB/s", "MD5 MB/s", "speedup");
+    printf("(MD5 = %s)\n", md5_name);
+
+    for (size_t size : sizes) {
+        std::string filename = format_str("hash_bench_%zu.i", size);
+        write_test_file(filename, size);
+
+        double rate[2];
+        for (int which = 0; which < 2; which++) {
+            // run for at least min_seconds. the file stays in the os cache, so this is hashing speed, not disk speed.
+            int reps = 0;
+            auto start = std::chrono::steady_clock::now();
+            do {
+                hash128 h;
+                bool ok = (which == 0) ? hash_file_contents(filename, h) : md5_file(filename);
+                if (!ok) {
+                    printf("failed to hash [%s]\n", filename.c_str());
+                    return 1;
+                }
+                reps++;
+            } while (seconds_since(start) < min_seconds);
+
+            rate[which] = (double)size * reps / (1024.0 * 1024.0) / seconds_since(start);
+        }
+
+        printf("%-12s %14.1f %14.1f %9.1fx\n", format_str("%zu KB", size / 1024).c_str(), rate[0], rate[1], rate[0] / rate[1]);
+        remove(filename.c_str());
+    }
+
+    // many files at once: sequential vs. the job pool
+    const size_t num_files = 64;
+    const size_t file_size = 2 * 1024 * 1024;
+    std::vector<std::string> files;
+    for (size_t n = 0; n < num_files; n++) {
+        files.push_back(format_str("hash_bench_many_%zu.i", n));
+        write_test_file(files.back(), file_size);
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (const auto& f : files) {
+        hash128 h;
+        hash_file_contents(f, h);
+    }
+    double sequential = seconds_since(start);
+
+    project_config conf;
+    job_pool pool(get_job_count(conf));
+    std::vector<hash128> hashes;
+    std::vector<char> ok;
+    start = std::chrono::steady_clock::now();
+    hash_files_parallel(pool, files, hashes, ok);
+    double parallel = seconds_since(start);
+
+    double total_mb = (double)num_files * file_size / (1024.0 * 1024.0);
+    printf("\n%zu x %zu KB files: sequential %.1f MB/s, parallel (%u jobs) %.1f MB/s\n",
+           num_files, file_size / 1024, total_mb / sequential, get_job_count(conf), total_mb / parallel);
+
+    for (const auto& f : files) remove(f.c_str());
+    return 0;
+}